@@ -37,15 +37,26 @@ INCLUDEPATH += \
 SOURCES += \
     src/main.cpp \
     src/AST/ast.cpp \
+    src/AST/fold.cpp \
     src/codegen/codegen.cpp \
     src/utils/symboltable.cpp \
+    src/utils/symbol.cpp \
     src/utils/runtime.cpp \
-    src/utils/codegencontext.cpp
+    src/utils/codegencontext.cpp \
+    src/utils/interface.cpp \
+    src/utils/timereport.cpp \
+    src/utils/jit.cpp
 
 HEADERS += \
     src/AST/ast.h \
+    src/utils/arena.h \
     src/utils/symboltable.h \
-    src/utils/codegencontext.h
+    src/utils/symbol.h \
+    src/utils/codegencontext.h \
+    src/utils/interface.h \
+    src/utils/timereport.h \
+    src/utils/runtime.h \
+    src/utils/jit.h
 
 OTHER_FILES += \
     src/tiger.l \
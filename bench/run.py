@@ -0,0 +1,229 @@
+#!/usr/bin/env python3
+"""Compile and run the Tiger benchmarks at every optimization level.
+
+For each bench/*.tig and each of -O0 ... -O3 this records
+
+  compile_s       wall time of the compiler, best of --repeat runs
+  compile_rss_kb  peak resident memory of the compiler
+  object_bytes    size of the object file
+  binary_bytes    size of the linked executable
+  run_s           wall time of the program, best of --repeat runs
+  run_rss_kb      peak resident memory of the program
+  output          MD5 of what the program printed
+
+and compares them with a baseline saved by an earlier run:
+
+  bench/run.py --compiler ./Tiny-Tiger --save bench/baseline.json
+  ... change the compiler ...
+  bench/run.py --compiler ./Tiny-Tiger --baseline bench/baseline.json
+
+The exit status is 1 if a program failed, if its output differs between
+optimization levels or from the baseline, or if a metric got worse than the
+baseline by more than the tolerance. Times of a few milliseconds are mostly
+noise, differences below --min-time seconds are ignored.
+
+Programs are compiled from stdin into output.o in a scratch directory, so
+that no interface cache is involved, and linked with the runtime library
+built from src/utils/runtime.cpp.
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT_DIR = os.path.dirname(BENCH_DIR)
+LEVELS = [0, 1, 2, 3]
+
+# Relative tolerances of the metrics, on top of the absolute --min-time for
+# the times.
+TOLERANCES = {
+    "compile_s": None,  # --tolerance
+    "run_s": None,  # --tolerance
+    "compile_rss_kb": 0.10,
+    "run_rss_kb": 0.10,
+    "object_bytes": 0.02,
+    "binary_bytes": 0.02,
+}
+
+
+def measure(command, cwd, stdin=None, stdout=subprocess.DEVNULL):
+    """Run `command`, return status, seconds, peak RSS in KiB and stderr."""
+    with tempfile.TemporaryFile() as stderr:
+        start = time.perf_counter()
+        process = subprocess.Popen(command, cwd=cwd, stdin=stdin,
+                                   stdout=stdout, stderr=stderr)
+        # wait4 gives the resource usage of this child alone.
+        _, status, usage = os.wait4(process.pid, 0)
+        elapsed = time.perf_counter() - start
+        if os.WIFEXITED(status):
+            process.returncode = os.WEXITSTATUS(status)
+        else:
+            process.returncode = -os.WTERMSIG(status)
+        stderr.seek(0)
+        error = stderr.read()
+    rss = usage.ru_maxrss
+    if sys.platform == "darwin":
+        rss //= 1024
+    return process.returncode, elapsed, rss, error
+
+
+def build_runtime(cxx, directory):
+    runtime = os.path.join(directory, "runtime.o")
+    subprocess.check_call([cxx, "-std=c++14", "-O2", "-c",
+                           os.path.join(ROOT_DIR, "src", "utils",
+                                        "runtime.cpp"),
+                           "-o", runtime])
+    return runtime
+
+
+def run_benchmark(args, source, level, runtime, directory):
+    result = {}
+    compile_times = []
+    for _ in range(args.repeat):
+        if os.path.exists(os.path.join(directory, "output.o")):
+            os.remove(os.path.join(directory, "output.o"))
+        with open(source) as program:
+            status, elapsed, rss, error = measure(
+                [args.compiler, "-O%d" % level] + args.flags, directory,
+                stdin=program)
+        if status != 0 or not os.path.exists(
+                os.path.join(directory, "output.o")):
+            raise RuntimeError("compilation failed:\n" + error.decode())
+        compile_times.append(elapsed)
+        result["compile_rss_kb"] = rss
+    result["compile_s"] = min(compile_times)
+    result["object_bytes"] = os.path.getsize(
+        os.path.join(directory, "output.o"))
+
+    binary = os.path.join(directory, "program")
+    subprocess.check_call([args.cxx, "output.o", runtime, "-pthread", "-o",
+                           binary], cwd=directory)
+    result["binary_bytes"] = os.path.getsize(binary)
+
+    run_times = []
+    output_file = os.path.join(directory, "stdout")
+    for _ in range(args.repeat):
+        with open(output_file, "wb") as output:
+            status, elapsed, rss, error = measure([binary], directory,
+                                                  stdout=output)
+        if status != 0:
+            raise RuntimeError("program exited with %d:\n%s" %
+                               (status, error.decode()))
+        run_times.append(elapsed)
+        result["run_rss_kb"] = rss
+    result["run_s"] = min(run_times)
+    with open(output_file, "rb") as output:
+        result["output"] = hashlib.md5(output.read()).hexdigest()
+    return result
+
+
+def compare(results, baseline, args):
+    """Print the changes against `baseline`, return the regressions."""
+    regressions = []
+    for key in sorted(results):
+        if key not in baseline:
+            continue
+        new, old = results[key], baseline[key]
+        if new["output"] != old["output"]:
+            regressions.append("%s: output changed" % key)
+        for metric, tolerance in TOLERANCES.items():
+            if metric not in old:
+                continue
+            if tolerance is None:
+                tolerance = args.tolerance
+            slack = args.min_time if metric.endswith("_s") else 0
+            change = (new[metric] - old[metric]) / old[metric] \
+                if old[metric] else 0.0
+            if new[metric] > old[metric] * (1 + tolerance) + slack:
+                regressions.append("%s: %s %g -> %g (%+.1f%%)" %
+                                   (key, metric, old[metric], new[metric],
+                                    change * 100))
+            elif abs(change) > tolerance and abs(
+                    new[metric] - old[metric]) > slack:
+                print("  %s: %s %g -> %g (%+.1f%%)" %
+                      (key, metric, old[metric], new[metric], change * 100))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--compiler", default=os.path.join(".", "Tiny-Tiger"),
+                        help="the Tiny Tiger compiler (default: %(default)s)")
+    parser.add_argument("--cxx", default=os.environ.get("CXX", "c++"),
+                        help="C++ compiler building and linking the runtime "
+                        "(default: $CXX or c++)")
+    parser.add_argument("--flags", default="",
+                        help="more compiler options, e.g. \"-mcpu=native\"")
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="runs of each measurement (default: 3)")
+    parser.add_argument("--tolerance", type=float, default=0.10,
+                        help="allowed relative slowdown (default: 0.10)")
+    parser.add_argument("--min-time", type=float, default=0.01,
+                        help="time differences ignored, in seconds "
+                        "(default: 0.01)")
+    parser.add_argument("--baseline", help="compare with this result file")
+    parser.add_argument("--save", help="write the results to this file")
+    parser.add_argument("benchmarks", nargs="*",
+                        help="names of the benchmarks (default: all)")
+    args = parser.parse_args()
+    args.compiler = os.path.abspath(args.compiler)
+    args.flags = args.flags.split()
+
+    names = args.benchmarks or sorted(
+        name[:-4] for name in os.listdir(BENCH_DIR) if name.endswith(".tig"))
+    directory = tempfile.mkdtemp(prefix="tiger-bench-")
+    failures = []
+    results = {}
+    try:
+        runtime = build_runtime(args.cxx, directory)
+        print("%-24s %10s %10s %10s %10s %10s" %
+              ("benchmark", "compile s", "object B", "run s", "run MiB",
+               "output"))
+        for name in names:
+            source = os.path.join(BENCH_DIR, name + ".tig")
+            outputs = set()
+            for level in LEVELS:
+                key = "%s -O%d" % (name, level)
+                try:
+                    result = run_benchmark(args, source, level, runtime,
+                                           directory)
+                except (RuntimeError, subprocess.CalledProcessError) as error:
+                    failures.append("%s: %s" % (key, error))
+                    print("%-24s failed" % key)
+                    continue
+                results[key] = result
+                outputs.add(result["output"])
+                print("%-24s %10.3f %10d %10.3f %10.1f %10s" %
+                      (key, result["compile_s"], result["object_bytes"],
+                       result["run_s"], result["run_rss_kb"] / 1024.0,
+                       result["output"][:8]))
+            if len(outputs) > 1:
+                failures.append("%s: output differs between levels" % name)
+    finally:
+        shutil.rmtree(directory)
+
+    if args.save:
+        with open(args.save, "w") as output:
+            json.dump(results, output, indent=2, sort_keys=True)
+            output.write("\n")
+    if args.baseline:
+        with open(args.baseline) as baseline:
+            print("\nChanges against %s:" % args.baseline)
+            failures += compare(results, json.load(baseline), args)
+
+    for failure in failures:
+        print("FAIL " + failure, file=sys.stderr)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,63 @@
+// Micro-benchmark of SymbolTable on the access pattern of deeply nested
+// let expressions:
+//
+//   let var v0_0 := 0 ... in
+//     let var v1_0 := v0_0 ... in
+//       ...
+//
+// Every level declares a few variables and reads variables of all the
+// enclosing levels, the way LetExp, VarDec and SimpleVar drive valueDecs.
+//
+// Build and run from the repository root:
+//   g++ -O2 -Isrc $(llvm-config --cxxflags) bench/symboltable.cpp
+//       src/utils/symbol.cpp $(llvm-config --ldflags --libs support)
+//       -o symboltable-bench
+//   ./symboltable-bench [depth] [variables per level] [repeat]
+
+#include <utils/symboltable.h>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+int main(int argc, char *argv[]) {
+  size_t depth = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 256;
+  size_t width = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 8;
+  size_t repeat = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 20;
+
+  // Names are interned once, like the lexer does for identifiers.
+  std::vector<std::vector<Symbol>> names(depth);
+  for (size_t level = 0; level != depth; ++level)
+    for (size_t i = 0; i != width; ++i)
+      names[level].push_back("v" + std::to_string(level) + "_" +
+                             std::to_string(i));
+  std::vector<int> values(width);
+  Symbol undefined("undefined");
+
+  size_t lookups = 0, found = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t r = 0; r != repeat; ++r) {
+    SymbolTable<int> table;
+    for (size_t level = 0; level != depth; ++level) {
+      table.enter();
+      for (size_t i = 0; i != width; ++i) {
+        if (!table.lookupOne(names[level][i]))
+          table.push(names[level][i], &values[i]);
+      }
+      // Read one variable of every enclosing level, plus an undefined name.
+      for (size_t outer = 0; outer <= level; ++outer, ++lookups)
+        if (table[names[outer][level % width]]) ++found;
+      if (!table[undefined]) ++lookups;
+    }
+    for (size_t level = 0; level != depth; ++level) table.exit();
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  std::cout << "depth " << depth << ", " << width << " variables per level: "
+            << lookups << " lookups (" << found << " found) in "
+            << elapsed.count() / 1e6 << " ms, "
+            << elapsed.count() / lookups << " ns per lookup" << std::endl;
+  return found == lookups - depth * repeat ? 0 : 1;
+}
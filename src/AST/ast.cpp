@@ -76,7 +76,8 @@ llvm::Type *AST::StringExp::traverse(vector<VarDec *> &,
 llvm::Type *CallExp::traverse(vector<VarDec *> &variableTable,
                               CodeGenContext &context) {
   auto function = context.functions[func_];
-  if (!function) return context.logErrorT("Function " + func_ + "undeclared");
+  if (!function) return context.logErrorT("Function " + func_.str() + "undeclared");
+  function_ = function;
   auto functionType = function->getFunctionType();
   size_t i = 0u;
   if (function->getLinkage() == llvm::Function::ExternalLinkage)
@@ -104,6 +105,8 @@ llvm::Type *BinaryExp::traverse(vector<VarDec *> &variableTable,
     case SUB:
     case MUL:
     case DIV:
+    case AND_:
+    case OR_:
     case LTH:
     case GTH:
     case LEQ:
@@ -132,8 +135,8 @@ llvm::Type *BinaryExp::traverse(vector<VarDec *> &variableTable,
 llvm::Type *Field::traverse(vector<VarDec *> &variableTable,
                             CodeGenContext &context) {
   type_ = context.typeOf(typeName_);
-  varDec_ =
-      new VarDec(name_, type_, variableTable.size(), context.currentLevel);
+  varDec_ = context.arena->make<VarDec>(name_, type_, variableTable.size(),
+                                        context.currentLevel);
   context.valueDecs.push(name_, varDec_);
   variableTable.push_back(varDec_);
   return type_;
@@ -160,8 +163,8 @@ llvm::Type *RecordExp::traverse(vector<VarDec *> &variableTable,
     auto &field = fieldExps_[idx];
     if (field->getName() != fieldDec->getName())
       return context.logErrorT(
-          field->getName() +
-          " is not a field or not on the right position of " + typeName_);
+          field->getName().str() +
+          " is not a field or not on the right position of " + typeName_.str());
     auto exp = field->traverse(variableTable, context);
     if (!context.isMatch(exp, fieldDec->getType()))
       return context.logErrorT("Field type not match");
@@ -229,8 +232,9 @@ llvm::Type *ForExp::traverse(vector<VarDec *> &variableTable,
   if (!high) return nullptr;
   if (!low->isIntegerTy() || !high->isIntegerTy())
     return context.logErrorT("For bounds require integer");
-  varDec_ = new VarDec(var_, context.intType, variableTable.size(),
-                       context.currentLevel);
+  varDec_ = context.arena->make<VarDec>(var_, context.intType,
+                                        variableTable.size(),
+                                        context.currentLevel);
   variableTable.push_back(varDec_);
   context.valueDecs.push(var_, varDec_);
   auto body = body_->traverse(variableTable, context);
@@ -264,7 +268,7 @@ llvm::Type *LetExp::traverse(vector<VarDec *> &variableTable,
 
 llvm::Type *TypeDec::traverse(vector<VarDec *> &, CodeGenContext &context) {
   type_->setName(name_);
-  context.typeDecs[name_] = type_.get();
+  context.typeDecs.push(name_, type_);
   return context.voidType;
 }
 
@@ -290,9 +294,11 @@ llvm::FunctionType *Prototype::traverse(vector<VarDec *> &variableTable,
   std::vector<llvm::Type *> args;
   auto linkType = llvm::PointerType::getUnqual(context.staticLink.front());
   args.push_back(linkType);
-  frame = llvm::StructType::create(context.context, name_ + "Frame");
-  staticLink_ = new VarDec("staticLink", linkType, variableTable.size(),
-                           context.currentLevel);
+  frame = llvm::StructType::create(context.context, name_.str() + "Frame");
+  staticLink_ = context.arena->make<VarDec>(
+      "staticLink", linkType, variableTable.size(), context.currentLevel);
+  // The static link is always the first slot of the frame.
+  staticLink_->setEscape();
   variableTable.push_back(staticLink_);
   for (auto &field : params_) {
     args.push_back(field->traverse(variableTable, context));
@@ -307,16 +313,21 @@ llvm::FunctionType *Prototype::traverse(vector<VarDec *> &variableTable,
   auto functionType = llvm::FunctionType::get(resultType_, args, false);
   function_ =
       llvm::Function::Create(functionType, llvm::Function::InternalLinkage,
-                             name_, context.module.get());
+                             name_.str(), context.module.get());
+  // Only called from the unit itself, fastcc lets the backend turn tail
+  // calls into jumps.
+  function_->setCallingConv(llvm::CallingConv::Fast);
+  function_->setDoesNotThrow();
   return functionType;
 }
 
 llvm::Type *FunctionDec::traverse(vector<VarDec *> &, CodeGenContext &context) {
   if (context.functions.lookupOne(name_))
-    return context.logErrorT("Function " + name_ +
+    return context.logErrorT("Function " + name_.str() +
                              " is already defined in same scope.");
   context.valueDecs.enter();
   level_ = ++context.currentLevel;
+  if (level_ == 1) context.unitFunctions.push_back(this);
   auto proto = proto_->traverse(variableTable_, context);
   if (!proto) return nullptr;
   context.staticLink.push_front(proto_->getFrame());
@@ -329,20 +340,22 @@ llvm::Type *FunctionDec::traverse(vector<VarDec *> &, CodeGenContext &context) {
   auto retType = proto_->getResultType();
   if (!retType->isVoidTy() && retType != body)
     return context.logErrorT("Function retrun type not match");
+  body_->markTail();
   return context.voidType;
 }
 
 llvm::Type *SimpleVar::traverse(vector<VarDec *> &, CodeGenContext &context) {
   // TODO: check
-  auto type = context.valueDecs[name_];
-  if (!type) return context.logErrorT(name_ + " is not defined");
-  return type->getType();
+  auto var = context.valueDecs[name_];
+  if (!var) return context.logErrorT(name_.str() + " is not defined");
+  if (var->getLevel() != context.currentLevel) var->setEscape();
+  return var->getType();
 }
 
 llvm::Type *VarDec::traverse(vector<VarDec *> &variableTable,
                              CodeGenContext &context) {
   if (context.valueDecs.lookupOne(name_))
-    return context.logErrorT(name_ + " is already defined in this function.");
+    return context.logErrorT(name_.str() + " is already defined in this function.");
   offset_ = variableTable.size();
   level_ = context.currentLevel;
   variableTable.push_back(this);
@@ -359,11 +372,11 @@ llvm::Type *VarDec::traverse(vector<VarDec *> &variableTable,
   return context.voidType;
 }
 
-llvm::Type *AST::ArrayType::traverse(std::set<std::string> &parentName,
+llvm::Type *AST::ArrayType::traverse(std::set<Symbol> &parentName,
                                      CodeGenContext &context) {
   if (context.types[name_]) return context.types[name_];
   if (parentName.find(name_) != parentName.end())
-    return context.logErrorT(name_ + " has an endless loop of type define");
+    return context.logErrorT(name_.str() + " has an endless loop of type define");
   parentName.insert(name_);
   auto type = context.typeOf(type_, parentName);
   parentName.erase(name_);
@@ -373,7 +386,7 @@ llvm::Type *AST::ArrayType::traverse(std::set<std::string> &parentName,
   return type;
 }
 
-llvm::Type *AST::NameType::traverse(std::set<std::string> &parentName,
+llvm::Type *AST::NameType::traverse(std::set<Symbol> &parentName,
                                     CodeGenContext &context) {
   if (auto type = context.types[name_]) return type;
   if (auto type = context.types[type_]) {
@@ -381,20 +394,20 @@ llvm::Type *AST::NameType::traverse(std::set<std::string> &parentName,
     return type;
   }
   if (parentName.find(name_) != parentName.end())
-    return context.logErrorT(name_ + " has an endless loop of type define");
+    return context.logErrorT(name_.str() + " has an endless loop of type define");
   parentName.insert(name_);
   auto type = context.typeOf(type_, parentName);
   parentName.erase(name_);
   return type;
 }
 
-llvm::Type *AST::RecordType::traverse(std::set<std::string> &parentName,
+llvm::Type *AST::RecordType::traverse(std::set<Symbol> &parentName,
                                       CodeGenContext &context) {
   if (context.types[name_]) return context.types[name_];
   std::vector<llvm::Type *> types;
   if (parentName.find(name_) != parentName.end()) {
     auto type = llvm::PointerType::getUnqual(
-        llvm::StructType::create(context.context, name_));
+        llvm::StructType::create(context.context, name_.str()));
     context.types.push(name_, type);
     return type;
   }
@@ -414,7 +427,7 @@ llvm::Type *AST::RecordType::traverse(std::set<std::string> &parentName,
     return type;
   } else {
     type = llvm::PointerType::getUnqual(
-        llvm::StructType::create(context.context, types, name_));
+        llvm::StructType::create(context.context, types, name_.str()));
     if (!type) return nullptr;
     context.types.push(name_, type);
     return type;
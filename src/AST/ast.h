@@ -1,11 +1,12 @@
 #ifndef AST_H
 #define AST_H
 
+#include <llvm/ADT/ArrayRef.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Value.h>
 #include <utils/codegencontext.h>
-#include <algorithm>
-#include <memory>
+#include <utils/symbol.h>
+#include <cstdint>
 #include <set>
 #include <string>
 #include <vector>
@@ -13,20 +14,28 @@
 class CodeGenContext;
 namespace AST {
 using llvm::Value;
-using std::move;
-using std::reverse;
 using std::set;
 using std::string;
-using std::unique_ptr;
 using std::vector;
 
+// Child lists are stored in the arena next to the nodes.
+template <typename T>
+using List = llvm::MutableArrayRef<T *>;
+
 class VarDec;
+class IntExp;
+class StringExp;
 
+// Nodes live in an Arena and are never deleted one by one, so the
+// destructors are not virtual: that keeps most of them trivial and lets the
+// arena release the whole tree at once.
 class Node {
   size_t pos_;
 
+ protected:
+  ~Node() = default;
+
  public:
-  virtual ~Node() = default;
   virtual Value *codegen(CodeGenContext &context) = 0;
   void setPos(const size_t &pos) { pos_ = pos; }
 
@@ -34,18 +43,38 @@ class Node {
 };
 
 class Var : public Node {
+ public:
+  // Fold the expressions in subscripts, see Exp::fold.
+  virtual void fold(CodeGenContext &) {}
 };
 
 class Exp : public Node {
+ public:
+  // Generate the expression as an i1 branch condition.
+  virtual Value *condition(CodeGenContext &context);
+  // Evaluate what can be known before code generation. Runs after traverse
+  // on well-typed trees and returns the node replacing this one, which is
+  // either this node with its children folded or a literal.
+  virtual Exp *fold(CodeGenContext &) { return this; }
+  // The literal this expression is, if any.
+  virtual IntExp *asIntExp() { return nullptr; }
+  virtual StringExp *asStringExp() { return nullptr; }
+  // The value of the expression is the result of the enclosing function,
+  // nothing is evaluated after it.
+  virtual void markTail() {}
 };
 
 class Root : public Node {
-  unique_ptr<Exp> root_;
+  Exp *root_;
   vector<VarDec *> mainVariableTable_;
-
+  // main, or <unit>.init of a library unit.
+  llvm::Function *mainFunction_{nullptr};
 
  public:
-  Root(unique_ptr<Exp> root) : root_(move(root)) {}
+  Root(Exp *root) : root_(root) {}
+  // Type checking and escape analysis, after which the exported functions of
+  // the unit are known. Run by codegen if it has not been run before.
+  bool analyze(CodeGenContext &context);
   Value *codegen(CodeGenContext &context) override;
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
@@ -53,70 +82,73 @@ class Root : public Node {
 
 class Dec : public Node {
  protected:
-  string name_;
+  Symbol name_;
 
  public:
-  Dec(string name) : name_(move(name)) {}
+  Dec(Symbol name) : name_(name) {}
+  virtual void fold(CodeGenContext &) {}
 };
 
 class Type {
  protected:
-  string name_;
+  Symbol name_{};
+
+  ~Type() = default;
 
  public:
   Type() = default;
-  void setName(string name) { name_ = move(name); }
-  const string &getName() const { return name_; }
-  virtual ~Type() = default;
-  virtual llvm::Type *traverse(std::set<string> &parentName,
+  void setName(Symbol name) { name_ = name; }
+  Symbol getName() const { return name_; }
+  virtual llvm::Type *traverse(std::set<Symbol> &parentName,
                                CodeGenContext &context) = 0;
 };
 
 class SimpleVar : public Var {
-  string name_;
+  Symbol name_;
 
  public:
-  SimpleVar(string name) : name_(move(name)) {}
+  SimpleVar(Symbol name) : name_(name) {}
   Value *codegen(CodeGenContext &context) override;
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
 };
 
 class FieldVar : public Var {
-  unique_ptr<Var> var_;
-  string field_;
+  Var *var_;
+  Symbol field_;
   llvm::Type *type_{nullptr};
   size_t idx_{0u};
 
  public:
-  FieldVar(unique_ptr<Var> var, string field)
-      : var_(move(var)), field_(move(field)) {}
+  FieldVar(Var *var, Symbol field) : var_(var), field_(field) {}
   Value *codegen(CodeGenContext &context) override;
+  void fold(CodeGenContext &context) override;
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
 };
 
 class SubscriptVar : public Var {
-  unique_ptr<Var> var_;
-  unique_ptr<Exp> exp_;
+  Var *var_;
+  Exp *exp_;
   llvm::Type *type_{nullptr};
 
  public:
-  SubscriptVar(unique_ptr<Var> var, unique_ptr<Exp> exp)
-      : var_(move(var)), exp_(move(exp)) {}
+  SubscriptVar(Var *var, Exp *exp) : var_(var), exp_(exp) {}
   Value *codegen(CodeGenContext &context) override;
+  void fold(CodeGenContext &context) override;
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
 };
 
 class VarExp : public Exp {
-  unique_ptr<Var> var_;
+  Var *var_;
 
  public:
-  VarExp(unique_ptr<Var> var) : var_(move(var)) {}
+  VarExp(Var *var) : var_(var) {}
   Value *codegen(CodeGenContext &context) override;
+  Exp *fold(CodeGenContext &context) override;
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
@@ -136,37 +168,43 @@ class NilExp : public Exp {
 };
 
 class IntExp : public Exp {
-  int val_;
+  std::int64_t val_;
 
  public:
-  IntExp(int const &val) : val_(val) {}
+  IntExp(std::int64_t const &val) : val_(val) {}
   Value *codegen(CodeGenContext &context) override;
+  IntExp *asIntExp() override { return this; }
+  std::int64_t getValue() const { return val_; }
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
 };
 
 class StringExp : public Exp {
-  string val_;
+  Symbol val_;
 
  public:
-  StringExp(string val) : val_(move(val)) {}
+  StringExp(Symbol val) : val_(val) {}
   Value *codegen(CodeGenContext &context) override;
+  StringExp *asStringExp() override { return this; }
+  Symbol getValue() const { return val_; }
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
 };
 
 class CallExp : public Exp {
-  string func_;
-  vector<unique_ptr<Exp>> args_;
+  Symbol func_;
+  List<Exp> args_;
+  // The function func_ names in the scope of the call, found by traverse.
+  llvm::Function *function_{nullptr};
+  bool tail_{false};
 
  public:
-  CallExp(string func, vector<unique_ptr<Exp>> args)
-      : func_(move(func)), args_(move(args)) {
-    reverse(args_.begin(), args_.end());
-  }
+  CallExp(Symbol func, List<Exp> args) : func_(func), args_(args) {}
   Value *codegen(CodeGenContext &context) override;
+  Exp *fold(CodeGenContext &context) override;
+  void markTail() override { tail_ = true; }
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
@@ -197,13 +235,17 @@ class BinaryExp : public Exp {
 
  private:
   Operator op_;  // TODO: use enum
-  unique_ptr<Exp> left_;
-  unique_ptr<Exp> right_;
+  Exp *left_;
+  Exp *right_;
+
+  Value *shortCircuit(CodeGenContext &context, bool asValue);
 
  public:
-  BinaryExp(Operator const &op, unique_ptr<Exp> left, unique_ptr<Exp> right)
-      : op_(op), left_(move(left)), right_(move(right)) {}
+  BinaryExp(Operator const &op, Exp *left, Exp *right)
+      : op_(op), left_(left), right_(right) {}
   Value *codegen(CodeGenContext &context) override;
+  Value *condition(CodeGenContext &context) override;
+  Exp *fold(CodeGenContext &context) override;
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
@@ -212,34 +254,34 @@ class BinaryExp : public Exp {
 class Field {
   friend class RecordType;
 
-  string name_;
-  string typeName_;
+  Symbol name_;
+  Symbol typeName_;
   llvm::Type *type_{nullptr};
   VarDec *varDec_{nullptr};
 
  public:
-  Field(string name, string type) : name_(move(name)), typeName_(move(type)) {}
+  Field(Symbol name, Symbol type) : name_(name), typeName_(type) {}
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context);
   llvm::Type *getType() const { return type_; }
-  const string &getName() const { return name_; }
+  Symbol getName() const { return name_; }
   VarDec *getVar() const { return varDec_; }
 };
 
 class FieldExp : public Exp {
   friend class RecordExp;
-  string name_;
-  unique_ptr<Exp> exp_;
+  Symbol name_;
+  Exp *exp_;
   llvm::Type *type_;
 
  public:
-  FieldExp(string name, unique_ptr<Exp> exp)
-      : name_(move(name)), exp_(move(exp)) {}
+  FieldExp(Symbol name, Exp *exp) : name_(name), exp_(exp) {}
 
-  const string &getName() const { return name_; }
+  Symbol getName() const { return name_; }
 
   Value *codegen(CodeGenContext &context) override;
+  Exp *fold(CodeGenContext &context) override;
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
@@ -247,90 +289,93 @@ class FieldExp : public Exp {
 
 class RecordExp : public Exp {
   friend class RecordType;
-  string typeName_;
-  vector<unique_ptr<FieldExp>> fieldExps_;
+  Symbol typeName_;
+  List<FieldExp> fieldExps_;
   llvm::Type *type_{nullptr};
 
  public:
-  RecordExp(string type, vector<unique_ptr<FieldExp>> fieldExps)
-      : typeName_(move(type)), fieldExps_(move(fieldExps)) {
-    reverse(fieldExps_.begin(), fieldExps_.end());
-  }
+  RecordExp(Symbol type, List<FieldExp> fieldExps)
+      : typeName_(type), fieldExps_(fieldExps) {}
   Value *codegen(CodeGenContext &context) override;
+  Exp *fold(CodeGenContext &context) override;
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
 };
 
 class SequenceExp : public Exp {
-  vector<unique_ptr<Exp>> exps_;
+  List<Exp> exps_;
 
  public:
-  SequenceExp(vector<unique_ptr<Exp>> exps) : exps_(move(exps)) {
-    reverse(exps_.begin(), exps_.end());
-  }
+  SequenceExp(List<Exp> exps) : exps_(exps) {}
   Value *codegen(CodeGenContext &context) override;
+  Exp *fold(CodeGenContext &context) override;
+  void markTail() override {
+    if (!exps_.empty()) exps_.back()->markTail();
+  }
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
 };
 
 class AssignExp : public Exp {
-  unique_ptr<Var> var_;
-  unique_ptr<Exp> exp_;
+  Var *var_;
+  Exp *exp_;
 
  public:
-  AssignExp(unique_ptr<Var> var, unique_ptr<Exp> exp)
-      : var_(move(var)), exp_(move(exp)) {}
+  AssignExp(Var *var, Exp *exp) : var_(var), exp_(exp) {}
   Value *codegen(CodeGenContext &context) override;
+  Exp *fold(CodeGenContext &context) override;
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
 };
 
 class IfExp : public Exp {
-  unique_ptr<Exp> test_;
-  unique_ptr<Exp> then_;
-  unique_ptr<Exp> else_;
+  Exp *test_;
+  Exp *then_;
+  Exp *else_;
 
  public:
-  IfExp(unique_ptr<Exp> test, unique_ptr<Exp> then, unique_ptr<Exp> elsee)
-      : test_(move(test)), then_(move(then)), else_(move(elsee)) {}
+  IfExp(Exp *test, Exp *then, Exp *elsee)
+      : test_(test), then_(then), else_(elsee) {}
   Value *codegen(CodeGenContext &context) override;
+  Exp *fold(CodeGenContext &context) override;
+  // Without else the result is void, which only a procedure may return.
+  void markTail() override {
+    then_->markTail();
+    if (else_) else_->markTail();
+  }
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
 };
 
 class WhileExp : public Exp {
-  unique_ptr<Exp> test_;
-  unique_ptr<Exp> body_;
+  Exp *test_;
+  Exp *body_;
 
  public:
-  WhileExp(unique_ptr<Exp> test, unique_ptr<Exp> body)
-      : test_(move(test)), body_(move(body)) {}
+  WhileExp(Exp *test, Exp *body) : test_(test), body_(body) {}
   Value *codegen(CodeGenContext &context) override;
+  Exp *fold(CodeGenContext &context) override;
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
 };
 
 class ForExp : public Exp {
-  string var_;
-  unique_ptr<Exp> low_;
-  unique_ptr<Exp> high_;
-  unique_ptr<Exp> body_;
-  // bool escape;
+  Symbol var_;
+  Exp *low_;
+  Exp *high_;
+  Exp *body_;
   VarDec *varDec_{nullptr};
 
  public:
-  ForExp(string var, unique_ptr<Exp> low, unique_ptr<Exp> high,
-         unique_ptr<Exp> body)
-      : var_(move(var)),
-        low_(move(low)),
-        high_(move(high)),
-        body_(move(body)) {}
+  ForExp(Symbol var, Exp *low, Exp *high, Exp *body)
+      : var_(var), low_(low), high_(high), body_(body) {}
   Value *codegen(CodeGenContext &context) override;
+  Exp *fold(CodeGenContext &context) override;
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
@@ -347,56 +392,54 @@ class BreakExp : public Exp {
 };
 
 class LetExp : public Exp {
-  vector<unique_ptr<Dec>> decs_;
-  unique_ptr<Exp> body_;
+  List<Dec> decs_;
+  Exp *body_;
 
  public:
-  LetExp(vector<unique_ptr<Dec>> decs, unique_ptr<Exp> body)
-      : decs_(move(decs)), body_(move(body)) {
-    reverse(decs_.begin(), decs_.end());
-  }
+  LetExp(List<Dec> decs, Exp *body) : decs_(decs), body_(body) {}
   Value *codegen(CodeGenContext &context) override;
+  Exp *fold(CodeGenContext &context) override;
+  void markTail() override { body_->markTail(); }
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
 };
 
 class ArrayExp : public Exp {
-  string typeName_;
-  unique_ptr<Exp> size_;
-  unique_ptr<Exp> init_;
+  Symbol typeName_;
+  Exp *size_;
+  Exp *init_;
   llvm::Type *type_{nullptr};
 
  public:
-  ArrayExp(string type, unique_ptr<Exp> size, unique_ptr<Exp> init)
-      : typeName_(move(type)), size_(move(size)), init_(move(init)) {}
+  ArrayExp(Symbol type, Exp *size, Exp *init)
+      : typeName_(type), size_(size), init_(init) {}
   Value *codegen(CodeGenContext &context) override;
+  Exp *fold(CodeGenContext &context) override;
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
 };
 
 class Prototype {
-  string name_;
-  vector<unique_ptr<Field>> params_;
-  string result_;
+  Symbol name_;
+  List<Field> params_;
+  Symbol result_;
   llvm::Type *resultType_{nullptr};
   llvm::Function *function_{nullptr};
   VarDec *staticLink_{nullptr};
   llvm::StructType *frame{nullptr};
 
  public:
-  Prototype(string name, vector<unique_ptr<Field>> params, string result)
-      : name_(move(name)), params_(move(params)), result_(move(result)) {
-    reverse(params_.begin(), params_.end());
-  }
+  Prototype(Symbol name, List<Field> params, Symbol result)
+      : name_(name), params_(params), result_(result) {}
   llvm::Function *codegen(CodeGenContext &context);
 
-  const string &getName() const { return name_; }
+  Symbol getName() const { return name_; }
 
-  void rename(string name) { name_ = move(name); }
+  void rename(Symbol name) { name_ = name; }
 
-  const vector<unique_ptr<Field>> &getParams() const { return params_; }
+  List<Field> getParams() const { return params_; }
 
   llvm::Type *getResultType() const { return resultType_; }
 
@@ -409,40 +452,56 @@ class Prototype {
 };
 
 class FunctionDec : public Dec {
-  unique_ptr<Prototype> proto_;
-  unique_ptr<Exp> body_;
+  Prototype *proto_;
+  Exp *body_;
   vector<VarDec *> variableTable_;
   size_t level_{0u};
+  // Start of the body, where self tail calls jump back to.
+  llvm::BasicBlock *recurse_{nullptr};
 
  public:
-  FunctionDec(string name, unique_ptr<Prototype> proto, unique_ptr<Exp> body)
-      : Dec(move(name)), proto_(move(proto)), body_(move(body)) {}
+  FunctionDec(Symbol name, Prototype *proto, Exp *body)
+      : Dec(name), proto_(proto), body_(body) {}
   Value *codegen(CodeGenContext &context) override;
+  void fold(CodeGenContext &context) override;
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
                        CodeGenContext &context) override;
+  Symbol getName() const { return name_; }
   Prototype &getProto() const { return *proto_; }
   size_t getLevel() const { return level_; }
+  // Call the function from the tail position of its own body.
+  Value *recurse(vector<Value *> const &args, CodeGenContext &context);
 };
 
 class VarDec : public Dec {
-  string typeName_;
-  unique_ptr<Exp> init_{nullptr};
-  // bool escape;
+  Symbol typeName_;
+  Exp *init_{nullptr};
+  // Set when a nested function references this variable; only escaping
+  // variables live in the static-link frame.
+  bool escape_{false};
   size_t offset_;
   size_t level_;
   llvm::Type *type_{nullptr};
+  llvm::Value *address_{nullptr};
 
  public:
-  VarDec(string name, string type, unique_ptr<Exp> init)
-      : Dec(move(name)), typeName_(move(type)), init_(move(init)) {}
-  VarDec(string name, llvm::Type *type, size_t const &offset,
+  VarDec(Symbol name, Symbol type, Exp *init)
+      : Dec(name), typeName_(type), init_(init) {}
+  VarDec(Symbol name, llvm::Type *type, size_t const &offset,
          size_t const &level)
-      : Dec(move(name)), offset_(offset), level_(level), type_(type) {}
+      : Dec(name), offset_(offset), level_(level), type_(type) {}
   Value *codegen(CodeGenContext &context) override;
+  void fold(CodeGenContext &context) override;
 
   llvm::Type *getType() const { return type_; }
-  const string &getName() const { return name_; }
+  Symbol getName() const { return name_; }
+  size_t getLevel() const { return level_; }
+
+  bool isEscape() const { return escape_; }
+  void setEscape() { escape_ = true; }
+  void setOffset(size_t const &offset) { offset_ = offset; }
+  void setAddress(llvm::Value *address) { address_ = address; }
 
   llvm::Value *read(CodeGenContext &context) const;
   llvm::Type *traverse(vector<VarDec *> &variableTable,
@@ -450,11 +509,10 @@ class VarDec : public Dec {
 };
 
 class TypeDec : public Dec {
-  unique_ptr<Type> type_;
+  Type *type_;
 
  public:
-  TypeDec(string name, unique_ptr<Type> type)
-      : Dec(move(name)), type_(move(type)) {}
+  TypeDec(Symbol name, Type *type) : Dec(name), type_(type) {}
   Value *codegen(CodeGenContext &context) override;
 
   llvm::Type *traverse(vector<VarDec *> &variableTable,
@@ -462,34 +520,32 @@ class TypeDec : public Dec {
 };
 
 class NameType : public Type {
-  string type_;
+  Symbol type_;
 
  public:
-  llvm::Type *traverse(std::set<string> &parentName,
+  llvm::Type *traverse(std::set<Symbol> &parentName,
                        CodeGenContext &context) override;
-  NameType(string type) : type_(move(type)) {}
+  NameType(Symbol type) : type_(type) {}
 };
 
 class RecordType : public Type {
   friend class RecordExp;
   friend class FieldVar;
-  vector<unique_ptr<Field>> fields_;
+  List<Field> fields_;
 
  public:
-  RecordType(vector<unique_ptr<Field>> fields) : fields_(move(fields)) {
-    reverse(fields_.begin(), fields_.end());
-  }
-  llvm::Type *traverse(std::set<string> &parentName,
+  RecordType(List<Field> fields) : fields_(fields) {}
+  llvm::Type *traverse(std::set<Symbol> &parentName,
                        CodeGenContext &context) override;
 };
 
 class ArrayType : public Type {
-  string type_;
+  Symbol type_;
 
  protected:
  public:
-  ArrayType(string type) : type_(move(type)) {}
-  llvm::Type *traverse(std::set<string> &parentName,
+  ArrayType(Symbol type) : type_(type) {}
+  llvm::Type *traverse(std::set<Symbol> &parentName,
                        CodeGenContext &context) override;
 };
 
@@ -0,0 +1,194 @@
+#include "ast.h"
+
+// Constant folding on the checked tree, run by Root::analyze between
+// traverse and codegen. Literal operands are combined into new literals, so
+// that code generation never sees them; string literals stay Symbols, which
+// are interned, and createString emits each distinct one once.
+
+using namespace AST;
+
+void FieldVar::fold(CodeGenContext &context) { var_->fold(context); }
+
+void SubscriptVar::fold(CodeGenContext &context) {
+  var_->fold(context);
+  exp_ = exp_->fold(context);
+}
+
+Exp *VarExp::fold(CodeGenContext &context) {
+  var_->fold(context);
+  return this;
+}
+
+// The runtime functions evaluated on literal arguments. User functions of the
+// same name are internal and imported ones are prefixed with their unit, so
+// an external function of this name is the runtime's.
+static bool isRuntime(llvm::Function *function, llvm::StringRef name) {
+  return function && function->getLinkage() == llvm::Function::ExternalLinkage &&
+         function->getName() == name;
+}
+
+Exp *CallExp::fold(CodeGenContext &context) {
+  for (auto &arg : args_) arg = arg->fold(context);
+  if (args_.size() == 1)
+    if (auto string = args_[0]->asStringExp()) {
+      auto value = string->getValue().ref();
+      if (isRuntime(function_, "size"))
+        return context.arena->make<IntExp>(value.size());
+      if (isRuntime(function_, "ord"))
+        return context.arena->make<IntExp>(
+            value.empty() || static_cast<unsigned char>(value[0]) > 127
+                ? -1
+                : value[0]);
+    }
+  if (args_.size() == 2 && isRuntime(function_, "concat")) {
+    auto left = args_[0]->asStringExp(), right = args_[1]->asStringExp();
+    if (left && right)
+      return context.arena->make<StringExp>(
+          Symbol(left->getValue().str() + right->getValue().str()));
+  }
+  return this;
+}
+
+Exp *BinaryExp::fold(CodeGenContext &context) {
+  left_ = left_->fold(context);
+  right_ = right_->fold(context);
+  auto left = left_->asIntExp(), right = right_->asIntExp();
+  // The right operand of a logical operator is only evaluated when the left
+  // one does not decide the result, and is the result otherwise: a & b is
+  // if a then b else 0 and a | b is if a then 1 else b.
+  if (left && op_ == AND_)
+    return left->getValue() == 0 ? context.arena->make<IntExp>(0) : right_;
+  if (left && op_ == OR_)
+    return left->getValue() != 0 ? context.arena->make<IntExp>(1) : right_;
+  if (!left || !right) {
+    auto leftString = left_->asStringExp(), rightString = right_->asStringExp();
+    if (!leftString || !rightString) return this;
+    // Ordered like strcmp_, bytewise and shorter prefixes first.
+    auto order = leftString->getValue().ref().compare(
+        rightString->getValue().ref());
+    switch (op_) {
+      case LTH:
+        return context.arena->make<IntExp>(order < 0);
+      case GTH:
+        return context.arena->make<IntExp>(order > 0);
+      case EQU:
+        return context.arena->make<IntExp>(order == 0);
+      case NEQU:
+        return context.arena->make<IntExp>(order != 0);
+      case LEQ:
+        return context.arena->make<IntExp>(order <= 0);
+      case GEQ:
+        return context.arena->make<IntExp>(order >= 0);
+      default:
+        return this;
+    }
+  }
+  auto l = left->getValue(), r = right->getValue();
+  // Arithmetic wraps around like the generated code.
+  auto ul = static_cast<std::uint64_t>(l), ur = static_cast<std::uint64_t>(r);
+  std::int64_t result;
+  switch (op_) {
+    case ADD:
+      result = static_cast<std::int64_t>(ul + ur);
+      break;
+    case SUB:
+      result = static_cast<std::int64_t>(ul - ur);
+      break;
+    case MUL:
+      result = static_cast<std::int64_t>(ul * ur);
+      break;
+    case DIV:
+      // Left to the run time, which reports the division by zero. Dividing
+      // by -1 negates with wrap around, like CodeGenContext::sdiv.
+      if (r == 0) return this;
+      result = r == -1 ? static_cast<std::int64_t>(0 - ul) : l / r;
+      break;
+    case XOR:
+      result = l ^ r;
+      break;
+    case LTH:
+      result = l < r;
+      break;
+    case GTH:
+      result = l > r;
+      break;
+    case EQU:
+      result = l == r;
+      break;
+    case NEQU:
+      result = l != r;
+      break;
+    case LEQ:
+      result = l <= r;
+      break;
+    case GEQ:
+      result = l >= r;
+      break;
+    default:
+      return this;
+  }
+  return context.arena->make<IntExp>(result);
+}
+
+Exp *FieldExp::fold(CodeGenContext &context) {
+  exp_ = exp_->fold(context);
+  return this;
+}
+
+Exp *RecordExp::fold(CodeGenContext &context) {
+  for (auto &field : fieldExps_) field->fold(context);
+  return this;
+}
+
+Exp *SequenceExp::fold(CodeGenContext &context) {
+  for (auto &exp : exps_) exp = exp->fold(context);
+  return this;
+}
+
+Exp *AssignExp::fold(CodeGenContext &context) {
+  var_->fold(context);
+  exp_ = exp_->fold(context);
+  return this;
+}
+
+// A known test could select a branch, but a nil branch gets its record type
+// from the other one, so the if is kept and the dead branch left to LLVM.
+Exp *IfExp::fold(CodeGenContext &context) {
+  test_ = test_->fold(context);
+  then_ = then_->fold(context);
+  if (else_) else_ = else_->fold(context);
+  return this;
+}
+
+Exp *WhileExp::fold(CodeGenContext &context) {
+  test_ = test_->fold(context);
+  body_ = body_->fold(context);
+  return this;
+}
+
+Exp *ForExp::fold(CodeGenContext &context) {
+  low_ = low_->fold(context);
+  high_ = high_->fold(context);
+  body_ = body_->fold(context);
+  return this;
+}
+
+Exp *LetExp::fold(CodeGenContext &context) {
+  for (auto &dec : decs_) dec->fold(context);
+  body_ = body_->fold(context);
+  return this;
+}
+
+Exp *ArrayExp::fold(CodeGenContext &context) {
+  size_ = size_->fold(context);
+  init_ = init_->fold(context);
+  return this;
+}
+
+void FunctionDec::fold(CodeGenContext &context) {
+  body_ = body_->fold(context);
+}
+
+void VarDec::fold(CodeGenContext &context) {
+  if (init_) init_ = init_->fold(context);
+}
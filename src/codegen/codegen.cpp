@@ -1,108 +1,137 @@
 #include <utils/codegencontext.h>
+#include <llvm/Analysis/ValueTracking.h>
 #include <iostream>
 #include <stack>
 #include <tuple>
 #include <unordered_map>
 #include "AST/ast.h"
 
-llvm::Value *AST::Root::codegen(CodeGenContext &context) {
-  // clear context.builder and context;
-  llvm::legacy::PassManager pm;
-  pm.add(llvm::createPrintModulePass(llvm::outs()));
-
-  llvm::InitializeAllTargetInfos();
-  llvm::InitializeAllTargets();
-  llvm::InitializeAllTargetMCs();
-  llvm::InitializeAllAsmParsers();
-  llvm::InitializeAllAsmPrinters();
-
-  auto targetTriple = llvm::sys::getDefaultTargetTriple();
-  context.module->setTargetTriple(targetTriple);
-
-  std::string error;
-  auto target = llvm::TargetRegistry::lookupTarget(targetTriple, error);
-
-  // Print an error and exit if we couldn't find the requested target.
-  // This generally occurs if we've forgotten to initialise the
-  // TargetRegistry or we have a bogus target triple.
-  if (!target) {
-    llvm::errs() << error;
-    return nullptr;
-  }
-
-  auto CPU = "generic";
-  auto features = "";
+// Lay out the frame of a function once escape analysis is done: variables
+// referenced by nested functions are kept in the static-link frame, the
+// others get their own entry block alloca so that mem2reg can promote them.
+// The outermost frame of a library unit is a global instead, its functions
+// are called after its initializer has returned.
+static llvm::Value *createFrame(llvm::Function *function,
+                                llvm::StructType *frame,
+                                std::vector<AST::VarDec *> &variableTable,
+                                const std::string &name,
+                                CodeGenContext &context, bool global = false) {
+  std::vector<llvm::Type *> localVar;
+  for (auto &var : variableTable)
+    if (var->isEscape()) {
+      var->setOffset(localVar.size());
+      localVar.push_back(var->getType());
+    }
+  frame->setBody(localVar);
+  llvm::Value *frameAddress;
+  if (global)
+    frameAddress = new llvm::GlobalVariable(
+        *context.module, frame, false, llvm::GlobalValue::InternalLinkage,
+        llvm::ConstantAggregateZero::get(frame), name);
+  else
+    frameAddress = context.createEntryBlockAlloca(function, frame, name);
+  for (auto &var : variableTable)
+    if (!var->isEscape())
+      var->setAddress(context.createEntryBlockAlloca(function, var->getType(),
+                                                     var->getName().str()));
+  return frameAddress;
+}
 
-  llvm::TargetOptions opt;
-  auto RM = llvm::Optional<llvm::Reloc::Model>();
-  auto targetMachine =
-      target->createTargetMachine(targetTriple, CPU, features, opt, RM);
+bool AST::Root::analyze(CodeGenContext &context) {
+  if (!context.createTargetMachine()) return false;
+  context.module->setModuleIdentifier(context.unitName);
 
-  context.module->setDataLayout(targetMachine->createDataLayout());
-  std::vector<llvm::Type *> args;
   auto mainProto = llvm::FunctionType::get(
-      llvm::Type::getInt64Ty(context.context), llvm::makeArrayRef(args), false);
-  auto mainFunction =
-      llvm::Function::Create(mainProto, llvm::GlobalValue::ExternalLinkage,
-                             "main", context.module.get());
+      context.library ? context.voidType : context.intType, false);
+  mainFunction_ = llvm::Function::Create(
+      mainProto, llvm::GlobalValue::ExternalLinkage,
+      context.library ? context.unitName + ".init" : "main",
+      context.module.get());
+  mainFunction_->setDoesNotThrow();
   context.staticLink.push_front(
-      llvm::StructType::create(context.context, "main"));
-  auto block = llvm::BasicBlock::Create(context.context, "entry", mainFunction);
-  context.types["int"] = context.intType;
-  context.types["string"] = context.stringType;
+      llvm::StructType::create(context.context, context.unitName));
+  context.types.push("int", context.intType);
+  context.types.push("string", context.stringType);
   context.intrinsic();
-  traverse(mainVariableTable_, context);
-  if (context.hasError) return nullptr;
-  context.valueDecs.reset();
-  context.functionDecs.reset();
-  context.builder.SetInsertPoint(block);
-  std::vector<llvm::Type *> localVar;
-  for (auto &var : mainVariableTable_) {
-    localVar.push_back(var->getType());
-    context.valueDecs.push(var->getName(), var);
-  }
-  context.staticLink.front()->setBody(localVar);
-  context.currentFrame = context.createEntryBlockAlloca(
-      mainFunction, context.staticLink.front(), "mainframe");
-  context.currentLevel = 0;
-  root_->codegen(context);
-  context.builder.CreateRet(llvm::ConstantInt::get(
-      llvm::Type::getInt64Ty(context.context), llvm::APInt(64, 0)));
-  if (llvm::verifyFunction(*mainFunction, &llvm::errs())) {
-    return context.logErrorV("Generate fail");
+  context.importFunctions();
+  {
+    TimeReport::Phase phase(context.timeReport, context.unitName, "analysis");
+    traverse(mainVariableTable_, context);
   }
-  // llvm::ReturnInst::Create(context, block);
-  std::cout << "Code is generated." << std::endl;
-
-  auto filename = "output.o";
-  std::error_code EC;
-  llvm::raw_fd_ostream dest(filename, EC, llvm::sys::fs::F_None);
+  if (context.hasError) return false;
+  TimeReport::Phase phase(context.timeReport, context.unitName,
+                          "constant folding");
+  root_ = root_->fold(context);
+  return true;
+}
 
-  if (EC) {
-    llvm::errs() << "Could not open file: " << EC.message();
-    return nullptr;
+llvm::Value *AST::Root::codegen(CodeGenContext &context) {
+  if (!mainFunction_ && !analyze(context)) return nullptr;
+  if (context.hasError) return nullptr;
+  {
+    TimeReport::Phase phase(context.timeReport, context.unitName,
+                            "code generation");
+    auto block =
+        llvm::BasicBlock::Create(context.context, "entry", mainFunction_);
+    context.valueDecs.reset();
+    context.functionDecs.reset();
+    context.builder.SetInsertPoint(block);
+    for (auto &var : mainVariableTable_)
+      context.valueDecs.push(var->getName(), var);
+    auto frame = context.staticLink.front();
+    context.currentFrame =
+        createFrame(mainFunction_, frame, mainVariableTable_,
+                    context.unitName + (context.library ? ".frame" : "frame"),
+                    context, context.library);
+    context.frames = {context.currentFrame};
+    context.currentLevel = 0;
+    if (context.library) {
+      // Objects only referenced from the global frame must survive.
+      auto addRoot = context.createIntrinsicFunction(
+          "addRoot", {context.builder.getInt8PtrTy(), context.intType},
+          context.voidType);
+      auto size = context.module->getDataLayout().getTypeAllocSize(frame);
+      auto frameStart = context.builder.CreateBitCast(
+          context.currentFrame, context.builder.getInt8PtrTy());
+      auto frameSize = llvm::ConstantInt::get(context.intType, size);
+      context.builder.CreateCall(
+          addRoot, std::vector<llvm::Value *>{frameStart, frameSize});
+    } else {
+      // The libraries are initialized in the order they were imported.
+      for (auto import : context.imports) {
+        auto init = llvm::Function::Create(
+            llvm::FunctionType::get(context.voidType, false),
+            llvm::GlobalValue::ExternalLinkage, import->unit + ".init",
+            context.module.get());
+        init->setDoesNotThrow();
+        context.builder.CreateCall(init);
+      }
+    }
+    root_->codegen(context);
+    if (context.library)
+      context.builder.CreateRetVoid();
+    else
+      context.builder.CreateRet(llvm::ConstantInt::get(
+          llvm::Type::getInt64Ty(context.context), llvm::APInt(64, 0)));
   }
-
-  // llvm::legacy::PassManager pass;
-  auto fileType = llvm::TargetMachine::CGFT_ObjectFile;
-
-  std::cout << "done." << std::endl;
-  if (targetMachine->addPassesToEmitFile(pm, dest, nullptr, fileType)) {
-    llvm::errs() << "TheTargetMachine can't emit a file of this type";
-    return nullptr;
+  {
+    TimeReport::Phase phase(context.timeReport, context.unitName,
+                            "verification");
+    if (llvm::verifyFunction(*mainFunction_, &llvm::errs())) {
+      return context.logErrorV("Generate fail");
+    }
   }
+  if (context.library) context.exportFunctions(context.currentFrame);
+  // llvm::ReturnInst::Create(context, block);
+  context.log("Code is generated.");
+  context.optimize(context.targetMachine.get());
 
-  pm.run(*context.module);
-  // pass.run(*module);
-  dest.flush();
-
-  llvm::outs() << "Wrote " << filename << "\n";
-  return nullptr;
+  return mainFunction_;
 }
 
 llvm::Value *AST::SimpleVar::codegen(CodeGenContext &context) {
   auto var = context.valueDecs[name_];
-  if (!var) return context.logErrorV("Unknown variable name " + name_);
+  if (!var) return context.logErrorV("Unknown variable name " + name_.str());
   return var->read(context);
 }
 
@@ -124,6 +153,14 @@ llvm::Value *AST::BreakExp::codegen(CodeGenContext &context) {
       llvm::Type::getInt64Ty(context.context));  // return nothing
 }
 
+// The loop counter is an i64 PHI running from low to high, both evaluated
+// once, so that LLVM sees a canonical induction variable with a known trip
+// count. The body reads the variable through its VarDec as usual: the store
+// at the top of each iteration is promoted away unless the variable escapes.
+// The back edge carries no llvm.loop hints: the vectorizer and unroller take
+// such loops on their own, while llvm.loop.vectorize.enable or .width would
+// override the cost model, and warn about every loop that cannot be
+// vectorized, such as one that calls print.
 llvm::Value *AST::ForExp::codegen(CodeGenContext &context) {
   auto low = low_->codegen(context);
   if (!low) return nullptr;
@@ -134,37 +171,24 @@ llvm::Value *AST::ForExp::codegen(CodeGenContext &context) {
   if (!high->getType()->isIntegerTy())
     return context.logErrorV("loop higher bound should be integer");
   auto function = context.builder.GetInsertBlock()->getParent();
-  // TODO: it should read only in the body
-  // auto variable = context.createEntryBlockAlloca(
-  // function, llvm::Type::getInt64Ty(context.context), var_);
-  // before loop:
-  context.builder.CreateStore(low, varDec_->read(context));
+  auto preheaderBB = context.builder.GetInsertBlock();
 
-  auto testBB = llvm::BasicBlock::Create(context.context, "test", function);
   auto loopBB = llvm::BasicBlock::Create(context.context, "loop", function);
   auto nextBB = llvm::BasicBlock::Create(context.context, "next", function);
   auto afterBB = llvm::BasicBlock::Create(context.context, "after", function);
   context.loopStack.push({nextBB, afterBB});
 
-  context.builder.CreateBr(testBB);
-
-  context.builder.SetInsertPoint(testBB);
-
-  auto EndCond = context.builder.CreateICmpSLE(
-      context.builder.CreateLoad(varDec_->read(context), var_), high,
-      "loopcond");
-  // auto loopEndBB = context.builder.GetInsertBlock();
-
-  // goto after or loop
-  context.builder.CreateCondBr(EndCond, loopBB, afterBB);
-
-  context.builder.SetInsertPoint(loopBB);
+  // before loop:
+  context.builder.CreateCondBr(
+      context.builder.CreateICmpSLE(low, high, "loopcond"), loopBB, afterBB);
 
   // loop:
-  // variable->addIncoming(low, preheadBB);
+  context.builder.SetInsertPoint(loopBB);
+  auto variable = context.builder.CreatePHI(context.intType, 2, var_.str());
+  variable->addIncoming(low, preheaderBB);
+  context.builder.CreateStore(variable, varDec_->read(context));
 
-  auto oldVal = context.valueDecs[var_];
-  if (oldVal) context.valueDecs.popOne(var_);
+  context.valueDecs.enter();
   context.valueDecs.push(var_, varDec_);
   // TODO: check its non-type value
   if (!body_->codegen(context)) return nullptr;
@@ -172,25 +196,17 @@ llvm::Value *AST::ForExp::codegen(CodeGenContext &context) {
   // goto next:
   context.builder.CreateBr(nextBB);
 
-  // next:
+  // next: compare before incrementing, high may be the largest integer.
   context.builder.SetInsertPoint(nextBB);
-
-  auto nextVar = context.builder.CreateAdd(
-      context.builder.CreateLoad(varDec_->read(context), var_),
-      llvm::ConstantInt::get(context.context, llvm::APInt(64, 1)), "nextvar");
-  context.builder.CreateStore(nextVar, varDec_->read(context));
-
-  context.builder.CreateBr(testBB);
+  auto endCond = context.builder.CreateICmpSLT(variable, high, "loopcond");
+  auto nextVar = context.builder.CreateNSWAdd(variable, context.one, "nextvar");
+  variable->addIncoming(nextVar, nextBB);
+  context.builder.CreateCondBr(endCond, loopBB, afterBB);
 
   // after:
   context.builder.SetInsertPoint(afterBB);
 
-  // variable->addIncoming(next, loopEndBB);
-
-  if (oldVal)
-    context.valueDecs[var_] = oldVal;
-  else
-    context.valueDecs.popOne(var_);
+  context.valueDecs.exit();
 
   context.loopStack.pop();
 
@@ -232,10 +248,9 @@ llvm::Value *AST::AssignExp::codegen(CodeGenContext &context) {
 }
 
 llvm::Value *AST::IfExp::codegen(CodeGenContext &context) {
-  auto test = test_->codegen(context);
+  auto test = test_->condition(context);
   if (!test) return nullptr;
 
-  test = context.builder.CreateICmpNE(test, context.zero, "iftest");
   auto function = context.builder.GetInsertBlock()->getParent();
 
   auto thenBB = llvm::BasicBlock::Create(context.context, "then", function);
@@ -293,14 +308,13 @@ llvm::Value *AST::WhileExp::codegen(CodeGenContext &context) {
 
   context.builder.SetInsertPoint(testBB);
 
-  auto test = test_->codegen(context);
+  auto test = test_->condition(context);
   if (!test) return nullptr;
 
-  auto EndCond = context.builder.CreateICmpEQ(test, context.zero, "loopcond");
   // auto loopEndBB = context.builder.GetInsertBlock();
 
-  // goto after or loop
-  context.builder.CreateCondBr(EndCond, afterBB, loopBB);
+  // goto loop or after
+  context.builder.CreateCondBr(test, loopBB, afterBB);
 
   context.builder.SetInsertPoint(loopBB);
 
@@ -324,6 +338,17 @@ llvm::Value *AST::WhileExp::codegen(CodeGenContext &context) {
   return llvm::Constant::getNullValue(llvm::Type::getInt64Ty(context.context));
 }
 
+// Code following a jump out of an expression is unreachable, but the
+// enclosing expressions still generate theirs: it goes to a block without
+// predecessors and the expression gets an undefined value.
+static llvm::Value *unreachableValue(llvm::Type *type,
+                                     CodeGenContext &context) {
+  auto function = context.builder.GetInsertBlock()->getParent();
+  context.builder.SetInsertPoint(
+      llvm::BasicBlock::Create(context.context, "unreachable", function));
+  return llvm::UndefValue::get(type);
+}
+
 llvm::Value *AST::CallExp::codegen(CodeGenContext &context) {
   auto callee = context.functionDecs[func_];
   llvm::Function *function;
@@ -331,7 +356,7 @@ llvm::Value *AST::CallExp::codegen(CodeGenContext &context) {
   size_t level = 0u;
   if (!callee) {
     function = context.functions[func_];
-    if (!function) return context.logErrorV("Function " + func_ + " not found");
+    if (!function) return context.logErrorV("Function " + func_.str() + " not found");
     type = llvm::Function::ExternalLinkage;
   } else {
     function = callee->getProto().getFunction();
@@ -341,28 +366,36 @@ llvm::Value *AST::CallExp::codegen(CodeGenContext &context) {
 
   // If argument mismatch error.
   std::vector<llvm::Value *> args;
-  if (type == llvm::Function::InternalLinkage) {
-    size_t currentLevel = context.currentLevel;
-    auto staticLink = context.staticLink.begin();
-    llvm::Value *value = context.currentFrame;
-    while (currentLevel-- >= level) {
-      value =
-          context.builder.CreateGEP(llvm::PointerType::getUnqual(*++staticLink),
-                                    value, context.zero, "staticLink");
-      value = context.builder.CreateLoad(value, "frame");
-    }
-    args.push_back(value);
-  }
+  // The static link of a function at `level` is the frame it is nested in.
+  if (type == llvm::Function::InternalLinkage)
+    args.push_back(context.frameOf(level - 1));
   for (size_t i = 0u; i != args_.size(); ++i) {
     args.push_back(args_[i]->codegen(context));
     if (!args.back()) return nullptr;
   }
 
-  if (function->getFunctionType()->getReturnType()->isVoidTy()) {
-    return context.builder.CreateCall(function, args);
-  } else {
-    return context.builder.CreateCall(function, args, "calltmp");
-  }
+  auto expansion = context.inlineCalls.find(function);
+  if (expansion != context.inlineCalls.end())
+    if (auto value = expansion->second(args)) return value;
+
+  // A nested function gets the frame of the caller, which must outlive the
+  // call; any other call in tail position returns right away.
+  bool tail = tail_ && level <= context.currentLevel;
+  auto caller = context.builder.GetInsertBlock()->getParent();
+  if (tail && callee && function == caller)
+    return callee->recurse(args, context);
+
+  auto returnType = function->getFunctionType()->getReturnType();
+  auto call = context.builder.CreateCall(function, args,
+                                         returnType->isVoidTy() ? "" : "calltmp");
+  call->setCallingConv(function->getCallingConv());
+  if (!tail) return call;
+  call->setTailCall();
+  if (caller->getReturnType()->isVoidTy())
+    context.builder.CreateRetVoid();
+  else
+    context.builder.CreateRet(call);
+  return unreachableValue(returnType, context);
 }
 
 llvm::Value *AST::ArrayExp::codegen(CodeGenContext &context) {
@@ -371,76 +404,63 @@ llvm::Value *AST::ArrayExp::codegen(CodeGenContext &context) {
   auto eleType = context.getElementType(type_);
   auto size = size_->codegen(context);
   auto init = init_->codegen(context);
+  if (!size || !init) return nullptr;
+  init = context.convertNil(init, llvm::Constant::getNullValue(eleType));
+  if (!init) return nullptr;
   auto eleSize = context.module->getDataLayout().getTypeAllocSize(eleType);
-  llvm::Value *arrayPtr = context.builder.CreateCall(
-      context.allocaArrayFunction,
-      std::vector<llvm::Value *>{
-          size, llvm::ConstantInt::get(llvm::Type::getInt64Ty(context.context),
-                                       llvm::APInt(64, eleSize))},
-      "alloca");
-  arrayPtr = context.builder.CreateBitCast(arrayPtr, type_, "array");
-
-  // auto arrayPtr = createEntryBlockAlloca(function, eleType, "arrayPtr",
-  // size);
-  auto zero = llvm::ConstantInt::get(context.context, llvm::APInt(64, 0, true));
-
-  std::string indexName = "index";
-  auto indexPtr = context.createEntryBlockAlloca(
-      function, llvm::Type::getInt64Ty(context.context), indexName);
-  // before loop:
-  context.builder.CreateStore(zero, indexPtr);
-
-  auto testBB = llvm::BasicBlock::Create(context.context, "test", function);
-  auto loopBB = llvm::BasicBlock::Create(context.context, "loop", function);
-  auto nextBB = llvm::BasicBlock::Create(context.context, "next", function);
-  auto afterBB = llvm::BasicBlock::Create(context.context, "after", function);
-
-  context.builder.CreateBr(testBB);
+  auto eleSizeValue =
+      llvm::ConstantInt::get(context.intType, llvm::APInt(64, eleSize));
+
+  // Zero and nil come cleared from the allocator, fresh large arrays
+  // without even touching their pages.
+  auto constant = llvm::dyn_cast<llvm::Constant>(init);
+  if (constant && constant->isNullValue()) {
+    auto arrayPtr = context.allocate(size, eleSize,
+                                     context.allocaZeroedArrayFunction,
+                                     {size, eleSizeValue}, true, true);
+    return context.builder.CreateBitCast(arrayPtr, type_, "array");
+  }
 
-  context.builder.SetInsertPoint(testBB);
+  llvm::Value *arrayPtr = context.allocate(
+      size, eleSize, context.allocaArrayFunction, {size, eleSizeValue}, true);
 
-  auto index = context.builder.CreateLoad(indexPtr, indexName);
-  auto EndCond = context.builder.CreateICmpSLT(index, size, "loopcond");
-  // auto loopEndBB = context.builder.GetInsertBlock();
+  // Values made of one repeated byte are a memset as well.
+  if (auto byte = llvm::isBytewiseValue(init)) {
+    context.builder.CreateMemSet(
+        arrayPtr, byte, context.builder.CreateMul(size, eleSizeValue), 8);
+    return context.builder.CreateBitCast(arrayPtr, type_, "array");
+  }
+  arrayPtr = context.builder.CreateBitCast(arrayPtr, type_, "array");
 
-  // goto after or loop
-  context.builder.CreateCondBr(EndCond, loopBB, afterBB);
+  // Anything else is stored by a loop simple enough to be vectorized.
+  auto preheaderBB = context.builder.GetInsertBlock();
+  auto loopBB = llvm::BasicBlock::Create(context.context, "fill", function);
+  auto afterBB = llvm::BasicBlock::Create(context.context, "filled", function);
+  context.builder.CreateCondBr(
+      context.builder.CreateICmpSGT(size, context.zero, "nonempty"), loopBB,
+      afterBB);
 
   context.builder.SetInsertPoint(loopBB);
-
-  // loop:
-  // variable->addIncoming(low, preheadBB);
-
-  // TODO: check its non-type value
+  auto index = context.builder.CreatePHI(context.intType, 2, "index");
+  index->addIncoming(context.zero, preheaderBB);
   auto elePtr = context.builder.CreateGEP(eleType, arrayPtr, index, "elePtr");
-  context.checkStore(init, elePtr);
-  // context.builder.CreateStore(init, elePtr);
-  // goto next:
-  context.builder.CreateBr(nextBB);
-
-  // next:
-  context.builder.SetInsertPoint(nextBB);
-
-  auto nextVar = context.builder.CreateAdd(
-      index, llvm::ConstantInt::get(context.context, llvm::APInt(64, 1)),
-      "nextvar");
-  context.builder.CreateStore(nextVar, indexPtr);
+  context.builder.CreateStore(init, elePtr);
+  auto nextVar = context.builder.CreateAdd(index, context.one, "nextvar");
+  index->addIncoming(nextVar, loopBB);
+  context.builder.CreateCondBr(
+      context.builder.CreateICmpSLT(nextVar, size, "loopcond"), loopBB,
+      afterBB);
 
-  context.builder.CreateBr(testBB);
-
-  // after:
   context.builder.SetInsertPoint(afterBB);
-
-  // variable->addIncoming(next, loopEndBB);
-
   return arrayPtr;
 }
 
 llvm::Value *AST::SubscriptVar::codegen(CodeGenContext &context) {
   auto var = var_->codegen(context);
   auto exp = exp_->codegen(context);
-  if (!var) return nullptr;
+  if (!var || !exp) return nullptr;
   var = context.builder.CreateLoad(var, "arrayPtr");
+  if (context.boundsCheck) context.checkBounds(var, exp);
   return context.builder.CreateGEP(type_, var, exp, "ptr");
 }
 llvm::Value *AST::FieldVar::codegen(CodeGenContext &context) {
@@ -462,15 +482,22 @@ llvm::Value *AST::RecordExp::codegen(CodeGenContext &context) {
   // auto var = createEntryBlockAlloca(function, type, "record");
   auto eleType = context.getElementType(type_);
   auto size = context.module->getDataLayout().getTypeAllocSize(eleType);
-  llvm::Value *var = context.builder.CreateCall(
-      context.allocaRecordFunction,
-      llvm::ConstantInt::get(context.intType, llvm::APInt(64, size)), "alloca");
+  // Evaluate the fields first: the record is then initialized right after it
+  // is allocated, before anything else can allocate.
+  std::vector<llvm::Value *> exps;
+  for (auto &field : fieldExps_) {
+    exps.push_back(field->codegen(context));
+    if (!exps.back()) return nullptr;
+    if (!field->type_) return nullptr;
+  }
+  auto sizeValue =
+      llvm::ConstantInt::get(context.intType, llvm::APInt(64, size));
+  llvm::Value *var = context.allocate(context.one, size,
+                                      context.allocaRecordFunction, {sizeValue});
   var = context.builder.CreateBitCast(var, type_, "record");
   size_t idx = 0u;
   for (auto &field : fieldExps_) {
-    auto exp = field->codegen(context);
-    if (!exp) return nullptr;
-    if (!field->type_) return nullptr;
+    auto exp = exps[idx];
     auto elementPtr = context.builder.CreateGEP(
         field->type_, var,
         llvm::ConstantInt::get(llvm::Type::getInt64Ty(context.context),
@@ -484,14 +511,22 @@ llvm::Value *AST::RecordExp::codegen(CodeGenContext &context) {
 }
 
 llvm::Value *AST::StringExp::codegen(CodeGenContext &context) {
-  return context.builder.CreateGlobalStringPtr(val_, "str");
+  return context.createString(val_.ref());
 }
 
-llvm::Function *AST::Prototype::codegen(CodeGenContext &) {
+llvm::Function *AST::Prototype::codegen(CodeGenContext &context) {
   auto *retType = resultType_;
 
   if (!retType) return nullptr;
 
+  // The static link is the frame of the enclosing function, laid out by
+  // now, which lives as long as any call of this one.
+  auto parentFrame = context.staticLink.front();
+  function_->addParamAttr(0, llvm::Attribute::NonNull);
+  if (auto size =
+          context.module->getDataLayout().getTypeAllocSize(parentFrame))
+    function_->addDereferenceableParamAttr(0, size);
+
   // auto oldFunc = functions[name_];
   // if (oldFunc) rename(oldFunc->getName().str() + "-");
 
@@ -504,7 +539,7 @@ llvm::Function *AST::Prototype::codegen(CodeGenContext &) {
 
   for (auto &arg : function_->args())
     if (idx >= offset)
-      arg.setName(params_[idx++ - offset]->getName());
+      arg.setName(params_[idx++ - offset]->getName().str());
     else {
       arg.setName("staticLink");
       ++idx;
@@ -516,7 +551,7 @@ llvm::Function *AST::Prototype::codegen(CodeGenContext &) {
 llvm::Value *AST::FunctionDec::codegen(CodeGenContext &context) {
   auto function = proto_->codegen(context);
   if (context.functionDecs.lookupOne(name_))
-    return context.logErrorV("Function " + name_ +
+    return context.logErrorV("Function " + name_.str() +
                              " is already defined in same scope.");
   // auto function = module->getFunction(proto.getName());
   if (!function) return nullptr;
@@ -529,26 +564,27 @@ llvm::Value *AST::FunctionDec::codegen(CodeGenContext &context) {
   context.valueDecs.enter();
   ++context.currentLevel;
   context.staticLink.push_front(proto_->getFrame());
-  std::vector<llvm::Type *> localVar;
-  for (auto &var : variableTable_) {
-    localVar.push_back(var->getType());
-  }
-  proto_->getFrame()->setBody(localVar);
   auto oldFrame = context.currentFrame;
-  context.currentFrame = context.createEntryBlockAlloca(
-      function, proto_->getFrame(), name_ + "frame");
+  auto oldFrames = std::move(context.frames);
+  context.currentFrame = createFrame(function, proto_->getFrame(),
+                                     variableTable_, name_.str() + "frame", context);
+  // The parent frame is the static link argument itself.
+  context.frames = {context.currentFrame, &*function->arg_begin()};
   size_t idx = 0u;
-  auto &params = proto_->getParams();
+  auto params = proto_->getParams();
   for (auto &arg : function->args()) {
     if (idx == 0) {
       context.builder.CreateStore(&arg, proto_->getStaticLink()->read(context));
       idx++;
     } else {
-      auto var = params[idx - 1]->getVar();
+      auto var = params[idx++ - 1]->getVar();
       context.builder.CreateStore(&arg, var->read(context));
       context.valueDecs.push(arg.getName(), var);
     }
   }
+  recurse_ = llvm::BasicBlock::Create(context.context, "body", function);
+  context.builder.CreateBr(recurse_);
+  context.builder.SetInsertPoint(recurse_);
   if (auto retVal = body_->codegen(context)) {
     if (proto_->getResultType()->isVoidTy()) {
       context.builder.CreateRetVoid();
@@ -559,6 +595,7 @@ llvm::Value *AST::FunctionDec::codegen(CodeGenContext &context) {
       context.valueDecs.exit();
       context.builder.SetInsertPoint(oldBB);
       context.currentFrame = oldFrame;
+      context.frames = std::move(oldFrames);
       context.staticLink.pop_front();
       --context.currentLevel;
       return function;
@@ -570,8 +607,21 @@ llvm::Value *AST::FunctionDec::codegen(CodeGenContext &context) {
   context.builder.SetInsertPoint(oldBB);
   context.staticLink.pop_front();
   context.currentFrame = oldFrame;
+  context.frames = std::move(oldFrames);
   --context.currentLevel;
-  return context.logErrorV("Function " + name_ + " genteration failed");
+  return context.logErrorV("Function " + name_.str() + " genteration failed");
+}
+
+// The frame of the running call is reused: the arguments become the new
+// values of the parameters and the body starts over, so that recursion in
+// tail position runs in constant stack space.
+llvm::Value *AST::FunctionDec::recurse(vector<Value *> const &args,
+                                       CodeGenContext &context) {
+  auto params = proto_->getParams();
+  for (size_t i = 0u; i != params.size(); ++i)
+    context.builder.CreateStore(args[i + 1], params[i]->getVar()->read(context));
+  context.builder.CreateBr(recurse_);
+  return unreachableValue(proto_->getResultType(), context);
 }
 
 llvm::Value *AST::VarDec::codegen(CodeGenContext &context) {
@@ -594,32 +644,82 @@ llvm::Value *AST::VarDec::codegen(CodeGenContext &context) {
 }
 
 llvm::Value *AST::VarDec::read(CodeGenContext &context) const {
-  size_t currentLevel = context.currentLevel;
-  auto staticLink = context.staticLink.begin();
-  llvm::Value *value = context.currentFrame;
-  while (currentLevel-- > level_) {
-    value =
-        context.builder.CreateGEP(llvm::PointerType::getUnqual(*++staticLink),
-                                  value, context.zero, "staticLink");
-    value = context.builder.CreateLoad(value, "frame");
-  }
+  if (!escape_) return address_;
+  auto frame = context.frameOf(level_);
+  auto frameType = context.staticLink[context.currentLevel - level_];
   std::vector<llvm::Value*> indices(2);
   indices[0] = llvm::ConstantInt::get(llvm::Type::getInt64Ty(context.context),
                              llvm::APInt(32, 0));
   indices[1] = llvm::ConstantInt::get(llvm::Type::getInt64Ty(context.context),
                              llvm::APInt(32, offset_));
-  return context.builder.CreateGEP(*staticLink, value, indices, name_);
+  return context.builder.CreateGEP(frameType, frame, indices, name_.str());
 }
 
 llvm::Value *AST::TypeDec::codegen(CodeGenContext &context) {
   return llvm::Constant::getNullValue(llvm::Type::getInt64Ty(context.context));
 }
 
+llvm::Value *AST::Exp::condition(CodeGenContext &context) {
+  auto value = codegen(context);
+  if (!value) return nullptr;
+  return context.builder.CreateICmpNE(value, context.zero, "test");
+}
+
+// Short circuit: the right operand is only evaluated when the left one does
+// not decide the result. As values, a & b is if a then b else 0 and a | b is
+// if a then 1 else b, so the right operand keeps its value; as conditions,
+// everything stays i1.
+llvm::Value *AST::BinaryExp::shortCircuit(CodeGenContext &context,
+                                          bool asValue) {
+  auto L = left_->condition(context);
+  if (!L) return nullptr;
+  auto function = context.builder.GetInsertBlock()->getParent();
+  auto leftBB = context.builder.GetInsertBlock();
+  auto rightBB = llvm::BasicBlock::Create(
+      context.context, op_ == AND_ ? "and.rhs" : "or.rhs", function);
+  auto mergeBB = llvm::BasicBlock::Create(
+      context.context, op_ == AND_ ? "and.end" : "or.end");
+  if (op_ == AND_)
+    context.builder.CreateCondBr(L, rightBB, mergeBB);
+  else
+    context.builder.CreateCondBr(L, mergeBB, rightBB);
+
+  context.builder.SetInsertPoint(rightBB);
+  auto R = asValue ? right_->codegen(context) : right_->condition(context);
+  if (!R) return nullptr;
+  context.builder.CreateBr(mergeBB);
+  rightBB = context.builder.GetInsertBlock();
+
+  function->getBasicBlockList().push_back(mergeBB);
+  context.builder.SetInsertPoint(mergeBB);
+  auto PN = context.builder.CreatePHI(R->getType(), 2,
+                                      op_ == AND_ ? "andtmp" : "ortmp");
+  PN->addIncoming(llvm::ConstantInt::get(R->getType(), op_ == OR_), leftBB);
+  PN->addIncoming(R, rightBB);
+  return PN;
+}
+
 llvm::Value *AST::BinaryExp::codegen(CodeGenContext &context) {
+  switch (op_) {
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case XOR:
+      break;
+    case AND_:
+    case OR_:
+      return shortCircuit(context, true);
+    default: {
+      // Comparisons are conditions widened to int.
+      auto test = condition(context);
+      if (!test) return nullptr;
+      return context.builder.CreateZExt(test, context.intType, "booltmp");
+    }
+  }
   auto L = left_->codegen(context);
   auto R = right_->codegen(context);
   if (!L || !R) return nullptr;
-  // TODO: check for nil
   switch (op_) {
     case ADD:
       return context.builder.CreateAdd(L, R, "addtmp");
@@ -628,75 +728,54 @@ llvm::Value *AST::BinaryExp::codegen(CodeGenContext &context) {
     case MUL:
       return context.builder.CreateMul(L, R, "multmp");
     case DIV:
-      return context.builder.CreateFPToSI(
-          context.builder.CreateFDiv(
-              context.builder.CreateSIToFP(
-                  L, llvm::Type::getDoubleTy(context.context)),
-              context.builder.CreateSIToFP(
-                  R, llvm::Type::getDoubleTy(context.context)),
-              "divftmp"),
-          llvm::Type::getInt64Ty(context.context), "divtmp");
+      return context.sdiv(L, R);
+    case XOR:
+      return context.builder.CreateXor(L, R, "xortmp");
+    default:
+      return nullptr;
+  }
+}
+
+llvm::Value *AST::BinaryExp::condition(CodeGenContext &context) {
+  switch (op_) {
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case XOR:
+      return Exp::condition(context);
+    case AND_:
+    case OR_:
+      return shortCircuit(context, false);
+    default:
+      break;
+  }
+  auto L = left_->codegen(context);
+  auto R = right_->codegen(context);
+  if (!L || !R) return nullptr;
+  if (op_ == EQU || op_ == NEQU) {
+    L = context.convertNil(L, R);
+    R = context.convertNil(R, L);
+    if (!L || !R) return nullptr;
+  }
+  if (L->getType() == context.stringType) {
+    L = context.strcmp(L, R);
+    R = context.zero;
+  }
+  switch (op_) {
     case LTH:
-      if(L->getType() == context.stringType) {
-        L = context.strcmp(L, R);
-        R = context.zero;
-      }
-      return context.builder.CreateZExt(
-          context.builder.CreateICmpSLT(L, R, "cmptmp"), context.intType,
-          "cmptmp");
+      return context.builder.CreateICmpSLT(L, R, "cmptmp");
     case GTH:
-      if(L->getType() == context.stringType) {
-        L = context.strcmp(L, R);
-        R = context.zero;
-      }
-      return context.builder.CreateZExt(
-          context.builder.CreateICmpSGT(L, R, "cmptmp"), context.intType,
-          "cmptmp");
+      return context.builder.CreateICmpSGT(L, R, "cmptmp");
     case EQU:
-      L = context.convertNil(L, R);
-      R = context.convertNil(R, L);
-      if(L->getType() == context.stringType) {
-        L = context.strcmp(L, R);
-        R = context.zero;
-      }
-      return context.builder.CreateZExt(
-          context.builder.CreateICmpEQ(L, R, "cmptmp"), context.intType,
-          "cmptmp");
+      return context.builder.CreateICmpEQ(L, R, "cmptmp");
     case NEQU:
-      L = context.convertNil(L, R);
-      R = context.convertNil(R, L);
-      if(L->getType() == context.stringType) {
-        L = context.strcmp(L, R);
-        R = context.zero;
-      }
-      if(L->getType() == context.stringType) {
-        return context.strcmp(L, R);
-      }
-      return context.builder.CreateZExt(
-          context.builder.CreateICmpNE(L, R, "cmptmp"), context.intType,
-          "cmptmp");
+      return context.builder.CreateICmpNE(L, R, "cmptmp");
     case LEQ:
-      if(L->getType() == context.stringType) {
-        L = context.strcmp(L, R);
-        R = context.zero;
-      }
-      return context.builder.CreateZExt(
-          context.builder.CreateICmpSLE(L, R, "cmptmp"), context.intType,
-          "cmptmp");
+      return context.builder.CreateICmpSLE(L, R, "cmptmp");
     case GEQ:
-      if(L->getType() == context.stringType) {
-        L = context.strcmp(L, R);
-        R = context.zero;
-      }
-      return context.builder.CreateZExt(
-          context.builder.CreateICmpSGE(L, R, "cmptmp"), context.intType,
-          "cmptmp");
-    case AND_:
-      return context.builder.CreateAnd(L, R, "andtmp");
-    case OR_:
-      return context.builder.CreateOr(L, R, "ortmp");
-    case XOR:
-      return context.builder.CreateXor(L, R, "xortmp");
+      return context.builder.CreateICmpSGE(L, R, "cmptmp");
+    default:
+      return nullptr;
   }
-  return nullptr;
 }
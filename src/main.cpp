@@ -1,19 +1,288 @@
 #include "AST/ast.h"
+#include "utils/arena.h"
+#include "utils/interface.h"
+#include "utils/timereport.h"
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Pass.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <iostream>
+#include <set>
+#include <thread>
 
 extern int tigerparse();
-extern std::unique_ptr<AST::Root> root;
+extern FILE *tigerin;
+extern void tigerrestart(FILE *input);
+extern Arena *arena;
+extern AST::Root *root;
 
-int main(int argc, char *argv[]) {
-  llvm::InitializeNativeTarget();
-  llvm::InitializeNativeTargetAsmPrinter();
-  llvm::InitializeNativeTargetAsmParser();
+static llvm::cl::list<std::string> inputs(
+    llvm::cl::Positional, llvm::cl::ZeroOrMore,
+    llvm::cl::desc("[<library.tig>...] <program.tig>, or the program on "
+                   "stdin"));
+
+static llvm::cl::opt<unsigned> optLevel(
+    "O", llvm::cl::desc("Optimization level: -O0, -O1, -O2 or -O3"),
+    llvm::cl::Prefix, llvm::cl::init(0u));
+
+static llvm::cl::opt<std::string> cpu(
+    "mcpu", llvm::cl::desc("Target CPU, \"native\" to detect the host"),
+    llvm::cl::value_desc("cpu-name"), llvm::cl::init("generic"));
+
+static llvm::cl::list<std::string> features(
+    "mattr", llvm::cl::CommaSeparated,
+    llvm::cl::desc("Target features to enable (+feature) or disable (-feature)"),
+    llvm::cl::value_desc("a1,+a2,-a3,..."));
+
+static llvm::cl::opt<llvm::Reloc::Model> relocModel(
+    "relocation-model", llvm::cl::desc("Relocation model"),
+    llvm::cl::values(
+        clEnumValN(llvm::Reloc::Static, "static", "Non-relocatable code"),
+        clEnumValN(llvm::Reloc::PIC_, "pic", "Position independent code"),
+        clEnumValN(llvm::Reloc::DynamicNoPIC, "dynamic-no-pic",
+                   "Relocatable external references, non-relocatable code")));
+
+static llvm::cl::opt<llvm::CodeModel::Model> codeModel(
+    "code-model", llvm::cl::desc("Code model"),
+    llvm::cl::values(
+        clEnumValN(llvm::CodeModel::Small, "small", "Small code model"),
+        clEnumValN(llvm::CodeModel::Kernel, "kernel", "Kernel code model"),
+        clEnumValN(llvm::CodeModel::Medium, "medium", "Medium code model"),
+        clEnumValN(llvm::CodeModel::Large, "large", "Large code model")));
+
+static llvm::cl::opt<bool> boundsCheck(
+    "fbounds-check", llvm::cl::desc("Check array subscripts at run time"));
+
+static llvm::cl::opt<bool> jit(
+    "jit", llvm::cl::desc("Run the program in-process instead of writing "
+                          "output.o"));
+
+static llvm::cl::opt<unsigned> jobs(
+    "j", llvm::cl::desc("Number of threads compiling units and large "
+                        "modules, one per core by default"),
+    llvm::cl::value_desc("N"), llvm::cl::init(0u));
+
+enum TimeReportFormat { Text, Json };
+static llvm::cl::opt<TimeReportFormat> timeReportFormat(
+    "ftime-report", llvm::cl::ValueOptional,
+    llvm::cl::desc("Report the time and memory taken by each compiler phase "
+                   "and LLVM pass on stderr"),
+    llvm::cl::values(clEnumValN(Text, "", "as text (default)"),
+                     clEnumValN(Text, "text", "as text"),
+                     clEnumValN(Json, "json", "as JSON")));
+
+// Set by -ftime-report.
+static TimeReport *report = nullptr;
+
+static unsigned threadCount() {
+  if (jobs) return jobs;
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+static void configure(CodeGenContext &context) {
+  context.threads = threadCount();
+  context.timeReport = report;
+  context.optLevel = optLevel;
+  context.boundsCheck = boundsCheck;
+  context.cpu = cpu;
+  context.features = features;
+  if (relocModel.getNumOccurrences())
+    context.relocModel = relocModel.getValue();
+  if (codeModel.getNumOccurrences())
+    context.codeModel = codeModel.getValue();
+}
+
+// Everything besides the sources the object files depend on.
+static std::string optionString() {
+  std::string options = "-O" + std::to_string(optLevel) + " -mcpu=" + cpu;
+  if (cpu == "native") options += "=" + llvm::sys::getHostCPUName().str();
+  for (auto &feature : features) options += " -mattr=" + feature;
+  if (relocModel.getNumOccurrences())
+    options += " -relocation-model=" + std::to_string(relocModel.getValue());
+  if (codeModel.getNumOccurrences())
+    options += " -code-model=" + std::to_string(codeModel.getValue());
+  if (boundsCheck) options += " -fbounds-check";
+  return options;
+}
 
-  tigerparse();
+struct Unit {
+  std::string source;
+  std::string object;
+  std::string interfaceFile;
+  Interface interface;
+  Arena arena;
+  AST::Root *root{nullptr};
+  // Null when the object file is up to date.
+  std::unique_ptr<CodeGenContext> context;
+};
+
+// Compile every input into <input>.o. The last input is the program, the
+// others are libraries which the program and the libraries after them call
+// through their interface. All units are analyzed first, one after the
+// other since the parser is not reentrant, which gives the interfaces; code
+// is then generated in parallel, each unit in its own LLVMContext.
+//
+// A unit whose source, options and imported interfaces hash to the object
+// hash of its interface file is not compiled again. When only the imports
+// changed, the interface saved next to the object is used as is.
+static int compileUnits() {
+  std::vector<std::unique_ptr<Unit>> units;
+  std::set<std::string> names;
+  auto options = optionString();
+  for (size_t i = 0; i != inputs.size(); ++i) {
+    auto unit = llvm::make_unique<Unit>();
+    unit->source = inputs[i];
+    llvm::SmallString<128> path(unit->source);
+    llvm::sys::path::replace_extension(path, "o");
+    unit->object = path.str().str();
+    llvm::sys::path::replace_extension(path, "tgi");
+    unit->interfaceFile = path.str().str();
+    auto name = llvm::sys::path::stem(unit->source).str();
+    if (!names.insert(name).second) {
+      std::cerr << "Unit " << name << " is given more than once" << std::endl;
+      return 1;
+    }
+    auto buffer = llvm::MemoryBuffer::getFile(unit->source);
+    if (!buffer) {
+      std::cerr << "Could not read " << unit->source << ": "
+                << buffer.getError().message() << std::endl;
+      return 1;
+    }
+
+    bool library = i + 1 != inputs.size();
+    std::vector<Interface const *> imports;
+    std::vector<std::string> signatures;
+    for (auto &import : units) {
+      imports.push_back(&import->interface);
+      signatures.push_back(import->interface.unit + "\n" +
+                           import->interface.signature());
+    }
+    auto sourceHash = hashOf({(*buffer)->getBuffer()});
+    std::vector<llvm::StringRef> parts{sourceHash, options,
+                                       library ? "library" : "program"};
+    parts.insert(parts.end(), signatures.begin(), signatures.end());
+    auto objectHash = hashOf(parts);
+
+    Interface cached;
+    if (cached.read(unit->interfaceFile) && cached.unit == name &&
+        cached.sourceHash == sourceHash && cached.objectHash == objectHash &&
+        llvm::sys::fs::exists(unit->object)) {
+      llvm::errs() << unit->object << " is up to date.\n";
+      unit->interface = std::move(cached);
+      units.push_back(std::move(unit));
+      continue;
+    }
+
+    auto file = std::fopen(unit->source.c_str(), "r");
+    if (!file) {
+      std::cerr << "Could not open " << unit->source << std::endl;
+      return 1;
+    }
+    tigerrestart(file);
+    arena = &unit->arena;
+    root = nullptr;
+    bool parseError;
+    {
+      TimeReport::Phase phase(report, name, "parse");
+      parseError = tigerparse() != 0 || !root;
+    }
+    std::fclose(file);
+    if (parseError) {
+      std::cerr << "Could not parse " << unit->source << std::endl;
+      return 1;
+    }
+    unit->root = root;
+    unit->context = llvm::make_unique<CodeGenContext>();
+    auto &context = *unit->context;
+    configure(context);
+    context.arena = &unit->arena;
+    context.unitName = name;
+    context.library = library;
+    context.imports = imports;
+    if (!root->analyze(context)) return 1;
+    unit->interface = context.exports();
+    unit->interface.sourceHash = sourceHash;
+    unit->interface.objectHash = objectHash;
+    units.push_back(std::move(unit));
+  }
+
+  std::vector<Unit *> pending;
+  for (auto &unit : units)
+    if (unit->context) pending.push_back(unit.get());
+  std::atomic<size_t> next{0};
+  std::atomic<bool> failed{false};
+  auto work = [&] {
+    for (size_t i; (i = next++) < pending.size();) {
+      auto &unit = *pending[i];
+      // The interface file is written last, so that a unit whose object
+      // could not be written is compiled again.
+      if (!unit.root->codegen(*unit.context) ||
+          !unit.context->emitObject(unit.object) ||
+          !unit.interface.write(unit.interfaceFile))
+        failed = true;
+    }
+  };
+  // Threads left over when there are fewer units go to their backends.
+  size_t threads = std::min<size_t>(threadCount(), pending.size());
+  for (auto unit : pending)
+    unit->context->threads = std::max<size_t>(1, threadCount() / threads);
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < threads; ++i) workers.emplace_back(work);
+  work();
+  for (auto &worker : workers) worker.join();
+  return failed ? 1 : 0;
+}
+
+// The single program read from stdin, or given with -jit.
+static int compileProgram() {
+  Arena astArena;
+  arena = &astArena;
+  {
+    TimeReport::Phase phase(report, "main", "parse");
+    tigerparse();
+  }
 
   if (root) {
     CodeGenContext codeGenContext;
-    root->codegen(codeGenContext);
+    codeGenContext.arena = &astArena;
+    configure(codeGenContext);
+    if (!root->codegen(codeGenContext)) return 1;
+    if (jit) return codeGenContext.runJIT();
+    if (!codeGenContext.emitObject("output.o")) return 1;
   }
   return 0;
 }
+
+int main(int argc, char *argv[]) {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::InitializeNativeTargetAsmParser();
+  llvm::cl::ParseCommandLineOptions(argc, argv, "Tiny Tiger compiler\n");
+  if (optLevel > 3) {
+    std::cerr << "Invalid optimization level -O" << optLevel << std::endl;
+    return 1;
+  }
+  if (jit && inputs.size() > 1) {
+    std::cerr << "-jit runs a single program" << std::endl;
+    return 1;
+  }
+  if (jit && !inputs.empty() &&
+      !(tigerin = std::fopen(inputs[0].c_str(), "r"))) {
+    std::cerr << "Could not open " << inputs[0] << std::endl;
+    return 1;
+  }
+
+  TimeReport timeReport;
+  if (timeReportFormat.getNumOccurrences()) {
+    report = &timeReport;
+    llvm::TimePassesIsEnabled = true;
+  }
+  auto result = !inputs.empty() && !jit ? compileUnits() : compileProgram();
+  if (report) report->print(llvm::errs(), timeReportFormat == Json);
+  return result;
+}
@@ -1,12 +1,13 @@
 %{
 #include <iostream>
 #include <AST/ast.h>
-#include <llvm/ADT/STLExtras.h>
+#include <utils/arena.h>
 using namespace AST;
 
 int yylex(void); /* function prototype */
 
-std::unique_ptr<Root> root;
+Arena *arena = nullptr;
+Root *root = nullptr;
 
 void tigererror(char *s)
 {
@@ -17,8 +18,8 @@ void tigererror(char *s)
 
 %union {
   int pos;
-  int ival;
-  std::string *sval;
+  std::int64_t ival;
+  Symbol sym;
   Var *var;
   Exp *exp;
   Dec *dec;
@@ -28,16 +29,13 @@ void tigererror(char *s)
   Root *root;
   FunctionDec *functionDec;
   TypeDec *typeDec;
-  std::vector<std::unique_ptr<Exp>> *expList;
-  std::vector<std::unique_ptr<Dec>> *decList;
-  std::vector<std::unique_ptr<Type>> *typeList;
-  std::vector<std::unique_ptr<Field>> *fieldList;
-  std::vector<std::unique_ptr<FieldExp>> *fieldExpList;
-  //std::vector<std::unique_ptr<Efield>> *efieldList;
-  std::vector<std::unique_ptr<NameType>> *nametypeList;
+  std::vector<Exp *> *expList;
+  std::vector<Dec *> *decList;
+  std::vector<Field *> *fieldList;
+  std::vector<FieldExp *> *fieldExpList;
 }
 
-%token <sval> ID STRING
+%token <sym> ID STRING
 %token <ival> INT
 
 %token
@@ -48,16 +46,16 @@ void tigererror(char *s)
 %type <var> lvalue
 %type <root> root
 %type <exp> exp let cond
-%type <expList> arglist nonarglist explist
+%type <expList> arglist nonarglist explist nonexplist
 %type <type> ty
 %type <dec> dec vardec
 %type <decList> decs
-%type <fieldList> tyfields
+%type <fieldList> tyfields nontyfields
 %type <field> tyfield
 %type <functionDec> fundec
 %type <typeDec> tydec
-%type <fieldExpList> reclist
-%type <sval> id
+%type <fieldExpList> reclist nonreclist
+%type <sym> id
 
 %nonassoc LOW
 %nonassoc THEN DO TYPE FUNCTION ID
@@ -73,58 +71,62 @@ void tigererror(char *s)
 
 %%
 
-prog:             root                              {root=std::unique_ptr<Root>($1);}
+prog:             root                              {root=$1;}
                 ;
 
 root:           /* empty */                         {$$=nullptr;}
-                | exp								{$$=new Root(std::unique_ptr<Exp>($1));}
-
-exp:              INT                       		{$$=new IntExp($1);}
-                | STRING							{$$=new StringExp(*$1); delete $1;}
-                | NIL								{$$=new NilExp();}
-                | lvalue							{$$=new VarExp(std::unique_ptr<Var>($1));}
-                | lvalue ASSIGN exp					{$$=new AssignExp(std::unique_ptr<Var>($1), std::unique_ptr<Exp>($3));}
-                | LPAREN explist RPAREN				{$$=new SequenceExp(std::move(*$2));}
+                | exp								{$$=arena->make<Root>($1);}
+
+exp:              INT                       		{$$=arena->make<IntExp>($1);}
+                | STRING							{$$=arena->make<StringExp>($1);}
+                | NIL								{$$=arena->make<NilExp>();}
+                | lvalue							{$$=arena->make<VarExp>($1);}
+                | lvalue ASSIGN exp					{$$=arena->make<AssignExp>($1, $3);}
+                | LPAREN explist RPAREN				{$$=arena->make<SequenceExp>(arena->list(*$2)); delete $2;}
                 | cond						    	{$$=$1;}
                 | let						    	{$$=$1;}
-                | exp OR exp						{$$=new IfExp(std::unique_ptr<Exp>($1), std::unique_ptr<Exp>(new IntExp(1)), std::unique_ptr<Exp>($3));}
-                | exp AND exp						{$$=new IfExp(std::unique_ptr<Exp>($1), std::unique_ptr<Exp>($3), std::unique_ptr<Exp>(new IntExp(0)));}
-                | exp LT exp						{$$=new BinaryExp(BinaryExp::LTH, std::unique_ptr<Exp>($1), std::unique_ptr<Exp>($3));}
-                | exp GT exp						{$$=new BinaryExp(BinaryExp::GTH, std::unique_ptr<Exp>($1), std::unique_ptr<Exp>($3));}
-                | exp LE exp						{$$=new BinaryExp(BinaryExp::LEQ, std::unique_ptr<Exp>($1), std::unique_ptr<Exp>($3));}
-                | exp GE exp						{$$=new BinaryExp(BinaryExp::GEQ, std::unique_ptr<Exp>($1), std::unique_ptr<Exp>($3));}
-                | exp PLUS exp						{$$=new BinaryExp(BinaryExp::ADD, std::unique_ptr<Exp>($1), std::unique_ptr<Exp>($3));}
-                | exp MINUS exp						{$$=new BinaryExp(BinaryExp::SUB, std::unique_ptr<Exp>($1), std::unique_ptr<Exp>($3));}
-                | exp TIMES exp						{$$=new BinaryExp(BinaryExp::MUL, std::unique_ptr<Exp>($1), std::unique_ptr<Exp>($3));}
-                | exp DIVIDE exp					{$$=new BinaryExp(BinaryExp::DIV, std::unique_ptr<Exp>($1), std::unique_ptr<Exp>($3));}
-                | MINUS exp %prec UMINUS			{$$=new BinaryExp(BinaryExp::SUB, std::unique_ptr<Exp>(new IntExp(0)), std::unique_ptr<Exp>($2));}
-                | exp EQ exp						{$$=new BinaryExp(BinaryExp::EQU, std::unique_ptr<Exp>($1), std::unique_ptr<Exp>($3));}
-                | exp NEQ exp						{$$=new BinaryExp(BinaryExp::NEQU, std::unique_ptr<Exp>($1), std::unique_ptr<Exp>($3));}
-                | id LPAREN arglist RPAREN			{$$=new CallExp(*$1, std::move(*$3)); delete $1;}
-                | id LBRACK exp RBRACK OF exp		{$$=new ArrayExp(*$1, std::unique_ptr<Exp>($3), std::unique_ptr<Exp>($6)); delete $1;}
-                | id LBRACE reclist RBRACE			{$$=new RecordExp(*$1, std::move(*$3)); delete $1;}
-                | BREAK								{$$=new BreakExp();}
-                ;
-
-reclist:        /* empty */                         {$$=new std::vector<std::unique_ptr<FieldExp>>();}
-                | id EQ exp							{$$=new std::vector<std::unique_ptr<FieldExp>>();
-                                                                                 $$->push_back(llvm::make_unique<FieldExp>(*$1, std::unique_ptr<Exp>($3)));
-                                                                                 delete $1;}
-                | id EQ exp	COMMA reclist		{$$=$5; $5->push_back(llvm::make_unique<FieldExp>(*$1, std::unique_ptr<Exp>($3))); delete $1;}
-
-let:              LET decs IN explist END			{$$=new LetExp(std::move(*$2), llvm::make_unique<SequenceExp>(std::move(*$4)));}
-                ;
-
-arglist:        /* empty */							{$$=new std::vector<std::unique_ptr<Exp>>();}
+                | exp OR exp						{$$=arena->make<BinaryExp>(BinaryExp::OR_, $1, $3);}
+                | exp AND exp						{$$=arena->make<BinaryExp>(BinaryExp::AND_, $1, $3);}
+                | exp LT exp						{$$=arena->make<BinaryExp>(BinaryExp::LTH, $1, $3);}
+                | exp GT exp						{$$=arena->make<BinaryExp>(BinaryExp::GTH, $1, $3);}
+                | exp LE exp						{$$=arena->make<BinaryExp>(BinaryExp::LEQ, $1, $3);}
+                | exp GE exp						{$$=arena->make<BinaryExp>(BinaryExp::GEQ, $1, $3);}
+                | exp PLUS exp						{$$=arena->make<BinaryExp>(BinaryExp::ADD, $1, $3);}
+                | exp MINUS exp						{$$=arena->make<BinaryExp>(BinaryExp::SUB, $1, $3);}
+                | exp TIMES exp						{$$=arena->make<BinaryExp>(BinaryExp::MUL, $1, $3);}
+                | exp DIVIDE exp					{$$=arena->make<BinaryExp>(BinaryExp::DIV, $1, $3);}
+                | MINUS exp %prec UMINUS			{$$=arena->make<BinaryExp>(BinaryExp::SUB, arena->make<IntExp>(0), $2);}
+                | exp EQ exp						{$$=arena->make<BinaryExp>(BinaryExp::EQU, $1, $3);}
+                | exp NEQ exp						{$$=arena->make<BinaryExp>(BinaryExp::NEQU, $1, $3);}
+                | id LPAREN arglist RPAREN			{$$=arena->make<CallExp>($1, arena->list(*$3)); delete $3;}
+                | id LBRACK exp RBRACK OF exp		{$$=arena->make<ArrayExp>($1, $3, $6);}
+                | id LBRACE reclist RBRACE			{$$=arena->make<RecordExp>($1, arena->list(*$3)); delete $3;}
+                | BREAK								{$$=arena->make<BreakExp>();}
+                ;
+
+// Lists are left recursive so that they are built in source order.
+reclist:        /* empty */                         {$$=new std::vector<FieldExp *>();}
+                | nonreclist						{$$=$1;}
+                | nonreclist COMMA					{$$=$1;}
+                ;
+
+nonreclist:       id EQ exp							{$$=new std::vector<FieldExp *>(); $$->push_back(arena->make<FieldExp>($1, $3));}
+                | nonreclist COMMA id EQ exp		{$$=$1; $1->push_back(arena->make<FieldExp>($3, $5));}
+                ;
+
+let:              LET decs IN explist END			{$$=arena->make<LetExp>(arena->list(*$2), arena->make<SequenceExp>(arena->list(*$4))); delete $2; delete $4;}
+                ;
+
+arglist:        /* empty */							{$$=new std::vector<Exp *>();}
                 | nonarglist						{$$=$1;}
                 ;
 
-nonarglist:       exp								{$$=new std::vector<std::unique_ptr<Exp>>();$$->push_back(std::unique_ptr<Exp>($1));}
-                | exp COMMA nonarglist				{$$=$3; $3->push_back(std::unique_ptr<Exp>($1));}
+nonarglist:       exp								{$$=new std::vector<Exp *>(); $$->push_back($1);}
+                | nonarglist COMMA exp				{$$=$1; $1->push_back($3);}
                 ;
 
-decs:           /* empty */							{$$=new std::vector<std::unique_ptr<Dec>>();}
-                | dec decs							{$$=$2; $2->push_back(std::unique_ptr<Dec>($1));}
+decs:           /* empty */							{$$=new std::vector<Dec *>();}
+                | decs dec							{$$=$1; $1->push_back($2);}
                 ;
 
 dec:              tydec 							{$$=$1;}
@@ -136,41 +138,49 @@ dec:              tydec 							{$$=$1;}
                 //| tydec tydecs						{$$=new TypeDec(A_NametyList($1, $2->u.type));}
                 //;
 
-lvalue:           id %prec LOW                      {$$=new SimpleVar(*$1); delete $1;}
-                | id LBRACK exp RBRACK 				{$$=new SubscriptVar(llvm::make_unique<SimpleVar>(*$1), std::unique_ptr<Exp>($3)); delete $1;}
-                | lvalue LBRACK exp RBRACK			{$$=new SubscriptVar(std::unique_ptr<Var>($1), std::unique_ptr<Exp>($3));}
-                | lvalue DOT id						{$$=new FieldVar(std::unique_ptr<Var>($1), *$3); delete $3;}
+lvalue:           id %prec LOW                      {$$=arena->make<SimpleVar>($1);}
+                | id LBRACK exp RBRACK 				{$$=arena->make<SubscriptVar>(arena->make<SimpleVar>($1), $3);}
+                | lvalue LBRACK exp RBRACK			{$$=arena->make<SubscriptVar>($1, $3);}
+                | lvalue DOT id						{$$=arena->make<FieldVar>($1, $3);}
+                ;
+
+explist:		/* empty */							{$$=new std::vector<Exp *>();}
+                | nonexplist						{$$=$1;}
+                | nonexplist SEMICOLON				{$$=$1;}
                 ;
 
-explist:		/* empty */							{$$=new std::vector<std::unique_ptr<Exp>>();}
-                | exp								{$$=new std::vector<std::unique_ptr<Exp>>(); $$->push_back(std::unique_ptr<Exp>($1));}
-                | exp SEMICOLON explist				{$$=$3; $3->push_back(std::unique_ptr<Exp>($1));}
+nonexplist:       exp								{$$=new std::vector<Exp *>(); $$->push_back($1);}
+                | nonexplist SEMICOLON exp			{$$=$1; $1->push_back($3);}
                 ;
 
-cond:             IF exp THEN exp ELSE exp			{$$=new IfExp(std::unique_ptr<Exp>($2), std::unique_ptr<Exp>($4), std::unique_ptr<Exp>($6));}
-                | IF exp THEN exp					{$$=new IfExp(std::unique_ptr<Exp>($2), std::unique_ptr<Exp>($4), nullptr);}
-                | WHILE exp DO exp					{$$=new WhileExp(std::unique_ptr<Exp>($2), std::unique_ptr<Exp>($4));}
-                | FOR id ASSIGN exp TO exp DO exp	{$$=new ForExp(*$2, std::unique_ptr<Exp>($4), std::unique_ptr<Exp>($6), std::unique_ptr<Exp>($8)); delete $2;}
+cond:             IF exp THEN exp ELSE exp			{$$=arena->make<IfExp>($2, $4, $6);}
+                | IF exp THEN exp					{$$=arena->make<IfExp>($2, $4, nullptr);}
+                | WHILE exp DO exp					{$$=arena->make<WhileExp>($2, $4);}
+                | FOR id ASSIGN exp TO exp DO exp	{$$=arena->make<ForExp>($2, $4, $6, $8);}
                 ;
 
-tydec:            TYPE id EQ ty						{$$=new TypeDec(*$2, std::unique_ptr<Type>($4)); delete $2;}
+tydec:            TYPE id EQ ty						{$$=arena->make<TypeDec>($2, $4);}
                 ;
 
-ty:               id								{$$=new NameType(*$1); delete $1;}
-                | LBRACE tyfields RBRACE			{$$=new RecordType(std::move(*$2));}
-                | ARRAY OF id						{$$=new ArrayType(*$3); delete $3;}
+ty:               id								{$$=arena->make<NameType>($1);}
+                | LBRACE tyfields RBRACE			{$$=arena->make<RecordType>(arena->list(*$2)); delete $2;}
+                | ARRAY OF id						{$$=arena->make<ArrayType>($3);}
                 ;
 
-tyfields:       /* empty */							{$$=new std::vector<std::unique_ptr<Field>>();}
-                | tyfield							{$$=new std::vector<std::unique_ptr<Field>>(); $$->push_back(std::unique_ptr<Field>($1));}
-                | tyfield COMMA tyfields			{$$=$3; $3->push_back(std::unique_ptr<Field>($1));}
+tyfields:       /* empty */							{$$=new std::vector<Field *>();}
+                | nontyfields						{$$=$1;}
+                | nontyfields COMMA					{$$=$1;}
                 ;
 
-tyfield:          id COLON id						{$$=new Field(*$1, *$3); delete $1; delete $3;}
+nontyfields:      tyfield							{$$=new std::vector<Field *>(); $$->push_back($1);}
+                | nontyfields COMMA tyfield			{$$=$1; $1->push_back($3);}
                 ;
 
-vardec:           VAR id ASSIGN exp					{$$=new VarDec(*$2, "", std::unique_ptr<Exp>($4)); delete $2;}
-                | VAR id COLON id ASSIGN exp		{$$=new VarDec(*$2, *$4, std::unique_ptr<Exp>($6)); delete $2; delete $4;}
+tyfield:          id COLON id						{$$=arena->make<Field>($1, $3);}
+                ;
+
+vardec:           VAR id ASSIGN exp					{$$=arena->make<VarDec>($2, Symbol(), $4);}
+                | VAR id COLON id ASSIGN exp		{$$=arena->make<VarDec>($2, $4, $6);}
                 ;
 
 id:               ID								{$$=$1;}
@@ -180,10 +190,9 @@ id:               ID								{$$=$1;}
                 //| fundec fundecs					{$$=A_FunctionDec(EM_tokPos, A_FundecList($1, $2->u.function));}
                 //;
 
-fundec:           FUNCTION id LPAREN tyfields RPAREN EQ exp				{$$=new FunctionDec(*$2, llvm::make_unique<Prototype>(*$2, std::move(*$4), ""), std::unique_ptr<Exp>($7)); delete $2;}
-                | FUNCTION id LPAREN tyfields RPAREN COLON id EQ exp	{$$=new FunctionDec(*$2, llvm::make_unique<Prototype>(*$2, std::move(*$4), *$7), std::unique_ptr<Exp>($9)); delete $2;}
+fundec:           FUNCTION id LPAREN tyfields RPAREN EQ exp				{$$=arena->make<FunctionDec>($2, arena->make<Prototype>($2, arena->list(*$4), Symbol()), $7); delete $4;}
+                | FUNCTION id LPAREN tyfields RPAREN COLON id EQ exp	{$$=arena->make<FunctionDec>($2, arena->make<Prototype>($2, arena->list(*$4), $7), $9); delete $4;}
                 ;
 
 
 
-
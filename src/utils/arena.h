@@ -0,0 +1,48 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/Support/Allocator.h>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump-pointer arena owning the AST of one compilation. Nodes are laid out
+// one after another in large slabs and released together with the arena.
+// Only the few node types that are not trivially destructible get their
+// destructor run; everything else is freed by dropping the slabs.
+class Arena {
+  llvm::BumpPtrAllocator allocator_;
+  std::vector<std::pair<void *, void (*)(void *)>> destructors_;
+
+ public:
+  Arena() = default;
+  Arena(Arena const &) = delete;
+  Arena &operator=(Arena const &) = delete;
+  ~Arena() {
+    for (auto &destructor : destructors_) destructor.second(destructor.first);
+  }
+
+  template <typename T, typename... Args>
+  T *make(Args &&... args) {
+    auto node = new (allocator_.Allocate<T>()) T(std::forward<Args>(args)...);
+    if (!std::is_trivially_destructible<T>::value)
+      destructors_.emplace_back(
+          node, [](void *node) { static_cast<T *>(node)->~T(); });
+    return node;
+  }
+
+  // Copy a list built by the parser into the arena.
+  template <typename T>
+  llvm::MutableArrayRef<T> list(std::vector<T> const &items) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "arena lists are never destroyed");
+    if (items.empty()) return {};
+    auto data = allocator_.Allocate<T>(items.size());
+    std::uninitialized_copy(items.begin(), items.end(), data);
+    return {data, items.size()};
+  }
+};
+
+#endif  // ARENA_H
@@ -1,22 +1,444 @@
 #include "codegencontext.h"
+#include <utils/jit.h>
+#include <utils/runtime.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/CodeGen/ParallelCG.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/MC/SubtargetFeature.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Utils.h>
+#include <chrono>
 #include <iostream>
+#include <map>
+#include <mutex>
 
-CodeGenContext::CodeGenContext() {}
+CodeGenContext::CodeGenContext() {
+  divisionByZeroFunction->setDoesNotReturn();
+  divisionByZeroFunction->addFnAttr(llvm::Attribute::Cold);
+  indexOutOfBoundsFunction->setDoesNotReturn();
+  indexOutOfBoundsFunction->addFnAttr(llvm::Attribute::Cold);
+  // Every call returns fresh memory.
+  allocaRecordFunction->addAttribute(llvm::AttributeList::ReturnIndex,
+                                     llvm::Attribute::NoAlias);
+  allocaArrayFunction->addAttribute(llvm::AttributeList::ReturnIndex,
+                                    llvm::Attribute::NoAlias);
+  allocaZeroedArrayFunction->addAttribute(llvm::AttributeList::ReturnIndex,
+                                          llvm::Attribute::NoAlias);
+  strCmpFunction->setOnlyReadsMemory();
+  auto areaType = llvm::StructType::create(
+      context, {builder.getInt8PtrTy(), builder.getInt8PtrTy()},
+      "AllocationArea");
+  allocationArea = new llvm::GlobalVariable(
+      *module, areaType, false, llvm::GlobalValue::ExternalLinkage, nullptr,
+      "allocationArea");
+}
 
 void CodeGenContext::intrinsic() {
-  functions["print"] = createIntrinsicFunction("print", {stringType}, voidType);
-  functions["printd"] = createIntrinsicFunction("printd", {intType}, voidType);
-  functions["flush"] = createIntrinsicFunction("flush", {}, voidType);
-  functions["getchar"] = createIntrinsicFunction("getchar_", {}, stringType);
-  functions["ord"] = createIntrinsicFunction("ord", {stringType}, intType);
-  functions["chr"] = createIntrinsicFunction("chr", {intType}, stringType);
-  functions["size"] = createIntrinsicFunction("size", {stringType}, intType);
-  functions["substring"] = createIntrinsicFunction(
+  functions.push("print",
+                 createIntrinsicFunction("print", {stringType}, voidType));
+  functions.push("printd",
+                 createIntrinsicFunction("printd", {intType}, voidType));
+  functions.push("flush", createIntrinsicFunction("flush", {}, voidType));
+  functions.push("getchar",
+                 createIntrinsicFunction("getchar_", {}, stringType));
+  auto ord = createIntrinsicFunction("ord", {stringType}, intType);
+  ord->setOnlyReadsMemory();
+  functions.push("ord", ord);
+  auto chr = createIntrinsicFunction("chr", {intType}, stringType);
+  functions.push("chr", chr);
+  // Valid characters are entries of the runtime's table, only invalid ones
+  // are left to chr, which stops the program.
+  inlineCalls[chr] = [this, chr](std::vector<llvm::Value *> const &args)
+      -> llvm::Value * {
+    auto c = args[0];
+    if (auto constant = llvm::dyn_cast<llvm::ConstantInt>(c))
+      return constant->getValue().ult(128) ? charString(c) : nullptr;
+    auto function = builder.GetInsertBlock()->getParent();
+    auto invalidBB = llvm::BasicBlock::Create(context, "chr.invalid", function);
+    auto validBB = llvm::BasicBlock::Create(context, "chr.valid", function);
+    builder.CreateCondBr(builder.CreateICmpULT(c, builder.getInt64(128)),
+                         validBB, invalidBB,
+                         llvm::MDBuilder(context).createBranchWeights(2000, 1));
+    builder.SetInsertPoint(invalidBB);
+    builder.CreateCall(chr, args);
+    builder.CreateUnreachable();
+    builder.SetInsertPoint(validBB);
+    return charString(c);
+  };
+  auto size = createIntrinsicFunction("size", {stringType}, intType);
+  size->setOnlyReadsMemory();
+  functions.push("size", size);
+  auto substring = createIntrinsicFunction(
       "substring", {stringType, intType, intType}, stringType);
-  functions["concat"] =
-      createIntrinsicFunction("concat", {stringType, stringType}, stringType);
-  functions["not"] = createIntrinsicFunction("not_", {intType}, intType);
-  functions["exit"] = createIntrinsicFunction("exit_", {intType}, voidType);
+  functions.push("substring", substring);
+  // substring(s, i, 1) is the table entry of s[i]. Indices outside the
+  // string are left to substring, which stops the program.
+  inlineCalls[substring] = [this, substring](
+      std::vector<llvm::Value *> const &args) -> llvm::Value * {
+    auto n = llvm::dyn_cast<llvm::ConstantInt>(args[2]);
+    if (!n || !n->isOne()) return nullptr;
+    auto function = builder.GetInsertBlock()->getParent();
+    auto invalidBB =
+        llvm::BasicBlock::Create(context, "substring.invalid", function);
+    auto validBB =
+        llvm::BasicBlock::Create(context, "substring.valid", function);
+    auto length = builder.CreateLoad(
+        builder.CreateGEP(
+            builder.CreateBitCast(args[0], llvm::PointerType::getUnqual(intType)),
+            builder.getInt64(-1)),
+        "length");
+    builder.CreateCondBr(builder.CreateICmpULT(args[1], length), validBB,
+                         invalidBB,
+                         llvm::MDBuilder(context).createBranchWeights(2000, 1));
+    builder.SetInsertPoint(invalidBB);
+    builder.CreateCall(substring, args);
+    builder.CreateUnreachable();
+    builder.SetInsertPoint(validBB);
+    auto c = builder.CreateLoad(builder.CreateGEP(args[0], args[1]), "char");
+    return charString(builder.CreateZExt(c, intType));
+  };
+  functions.push("concat", createIntrinsicFunction(
+                               "concat", {stringType, stringType}, stringType));
+  functions.push("not", createIntrinsicFunction("not_", {intType}, intType));
+  auto exit = createIntrinsicFunction("exit_", {intType}, voidType);
+  exit->setDoesNotReturn();
+  functions.push("exit", exit);
+}
+
+// Only ints and strings mean the same in every unit, records and arrays are
+// types of the unit that declares them.
+static std::string interfaceTypeName(llvm::Type *type,
+                                     CodeGenContext &context) {
+  if (type == context.intType) return "int";
+  if (type == context.stringType) return "string";
+  return {};
+}
+
+void CodeGenContext::importFunctions() {
+  for (auto import : imports)
+    for (auto &function : import->functions) {
+      std::vector<llvm::Type *> params;
+      for (auto &param : function.params)
+        params.push_back(param == "int" ? intType : stringType);
+      auto result = function.result.empty()
+                        ? voidType
+                        : function.result == "int" ? intType : stringType;
+      functions.push(function.name,
+                     createIntrinsicFunction(import->unit + "." + function.name,
+                                             params, result));
+    }
+}
+
+std::vector<AST::FunctionDec *> CodeGenContext::exportedFunctions() {
+  // Names declared more than once at the outermost level are ambiguous.
+  std::map<Symbol, size_t> count;
+  for (auto function : unitFunctions) ++count[function->getName()];
+  std::vector<AST::FunctionDec *> exported;
+  for (auto function : unitFunctions) {
+    if (count[function->getName()] != 1) continue;
+    auto type = function->getProto().getFunction()->getFunctionType();
+    bool exportable = type->getReturnType()->isVoidTy() ||
+                      !interfaceTypeName(type->getReturnType(), *this).empty();
+    for (auto param : type->params().drop_front())
+      exportable = exportable && !interfaceTypeName(param, *this).empty();
+    if (exportable) exported.push_back(function);
+  }
+  return exported;
+}
+
+Interface CodeGenContext::exports() {
+  Interface interface;
+  interface.unit = unitName;
+  for (auto function : exportedFunctions()) {
+    auto type = function->getProto().getFunction()->getFunctionType();
+    Interface::Function entry{function->getName().str(), {}, {}};
+    for (auto param : type->params().drop_front())
+      entry.params.push_back(interfaceTypeName(param, *this));
+    entry.result = interfaceTypeName(type->getReturnType(), *this);
+    interface.functions.push_back(std::move(entry));
+  }
+  return interface;
+}
+
+// Exported functions are entered through <unit>.<function>, which passes the
+// global frame of the unit as static link.
+void CodeGenContext::exportFunctions(llvm::Value *frame) {
+  for (auto exported : exportedFunctions()) {
+    auto function = exported->getProto().getFunction();
+    auto type = function->getFunctionType();
+    auto entryType = llvm::FunctionType::get(
+        type->getReturnType(), type->params().drop_front(), false);
+    auto entry = llvm::Function::Create(
+        entryType, llvm::Function::ExternalLinkage,
+        unitName + "." + exported->getName().str(), module.get());
+    entry->setDoesNotThrow();
+    llvm::IRBuilder<> entryBuilder(
+        llvm::BasicBlock::Create(context, "entry", entry));
+    std::vector<llvm::Value *> args{frame};
+    for (auto &arg : entry->args()) args.push_back(&arg);
+    auto call = entryBuilder.CreateCall(function, args);
+    call->setCallingConv(function->getCallingConv());
+    if (type->getReturnType()->isVoidTy())
+      entryBuilder.CreateRetVoid();
+    else
+      entryBuilder.CreateRet(call);
+  }
+}
+
+// A target machine for the selected target, owned by the caller. The
+// backend threads of emitObject each need their own.
+llvm::TargetMachine *CodeGenContext::newTargetMachine() {
+  // Units are compiled on several threads, the registry is filled once.
+  static std::once_flag initialized;
+  std::call_once(initialized, [] {
+    llvm::InitializeAllTargetInfos();
+    llvm::InitializeAllTargets();
+    llvm::InitializeAllTargetMCs();
+    llvm::InitializeAllAsmParsers();
+    llvm::InitializeAllAsmPrinters();
+  });
+
+  auto targetTriple = llvm::sys::getDefaultTargetTriple();
+  std::string error;
+  auto target = llvm::TargetRegistry::lookupTarget(targetTriple, error);
+
+  // Print an error and exit if we couldn't find the requested target.
+  // This generally occurs if we've forgotten to initialise the
+  // TargetRegistry or we have a bogus target triple.
+  if (!target) {
+    llvm::errs() << error;
+    return nullptr;
+  }
+
+  std::string CPU = cpu;
+  llvm::SubtargetFeatures subtargetFeatures;
+  if (cpu == "native") {
+    CPU = llvm::sys::getHostCPUName();
+    llvm::StringMap<bool> hostFeatures;
+    if (llvm::sys::getHostCPUFeatures(hostFeatures))
+      for (auto &feature : hostFeatures)
+        subtargetFeatures.AddFeature(feature.first(), feature.second);
+  }
+  // Explicit -mattr entries come last so they override the host features.
+  for (auto &feature : features) subtargetFeatures.AddFeature(feature);
+
+  auto level = llvm::CodeGenOpt::None;
+  if (optLevel == 1)
+    level = llvm::CodeGenOpt::Less;
+  else if (optLevel == 2)
+    level = llvm::CodeGenOpt::Default;
+  else if (optLevel == 3)
+    level = llvm::CodeGenOpt::Aggressive;
+
+  llvm::TargetOptions opt;
+  // Calls between fastcc functions marked tail in tail position become
+  // jumps, even when their arguments do not fit in the caller's frame.
+  opt.GuaranteedTailCallOpt = true;
+  auto targetMachine = target->createTargetMachine(
+      targetTriple, CPU, subtargetFeatures.getString(), opt, relocModel,
+      codeModel, level);
+  if (!targetMachine)
+    llvm::errs() << "Could not create target machine for " << CPU << "\n";
+  return targetMachine;
+}
+
+llvm::TargetMachine *CodeGenContext::createTargetMachine() {
+  auto targetMachine = newTargetMachine();
+  if (!targetMachine) return nullptr;
+  auto targetTriple = targetMachine->getTargetTriple().str();
+  module->setTargetTriple(targetTriple);
+  module->setDataLayout(targetMachine->createDataLayout());
+  this->targetMachine.reset(targetMachine);
+  return targetMachine;
+}
+
+void CodeGenContext::optimize(llvm::TargetMachine *targetMachine) {
+  TimeReport::Phase phase(timeReport, unitName, "optimization");
+  llvm::legacy::FunctionPassManager fpm(module.get());
+  llvm::legacy::PassManager mpm;
+  fpm.add(llvm::createTargetTransformInfoWrapperPass(
+      targetMachine->getTargetIRAnalysis()));
+  mpm.add(llvm::createTargetTransformInfoWrapperPass(
+      targetMachine->getTargetIRAnalysis()));
+
+  llvm::PassManagerBuilder passBuilder;
+  passBuilder.OptLevel = optLevel;
+  passBuilder.SizeLevel = 0;
+  if (optLevel > 1)
+    passBuilder.Inliner = llvm::createFunctionInliningPass(optLevel, 0, false);
+  passBuilder.LoopVectorize = optLevel > 1;
+  passBuilder.SLPVectorize = optLevel > 1;
+  // Loops over arrays mostly check indices of their induction variable,
+  // which this splits off into a check free main loop.
+  if (boundsCheck)
+    passBuilder.addExtension(
+        llvm::PassManagerBuilder::EP_LoopOptimizerEnd,
+        [](const llvm::PassManagerBuilder &,
+           llvm::legacy::PassManagerBase &pm) {
+          pm.add(llvm::createInductiveRangeCheckEliminationPass());
+        });
+  targetMachine->adjustPassManager(passBuilder);
+  // Variables that do not escape, parameters included, have allocas of their
+  // own so that they can live in registers, even without optimization.
+  if (optLevel == 0) fpm.add(llvm::createPromoteMemoryToRegisterPass());
+  passBuilder.populateFunctionPassManager(fpm);
+  passBuilder.populateModulePassManager(mpm);
+
+  // Nested functions are internal, so run the function pipeline on every
+  // definition of the module, not only on main.
+  fpm.doInitialization();
+  for (auto &function : *module)
+    if (!function.isDeclaration()) fpm.run(function);
+  fpm.doFinalization();
+  mpm.run(*module);
+}
+
+// Units are compiled on several threads at once, so output of the compiler
+// is written in one piece under this lock.
+static std::mutex outputMutex;
+
+// A progress line, prefixed with the unit it belongs to.
+void CodeGenContext::log(std::string const &line) {
+  auto text = unitName + ": " + line + "\n";
+  std::lock_guard<std::mutex> lock(outputMutex);
+  llvm::errs() << text;
+}
+
+bool CodeGenContext::emitObject(std::string const &filename) {
+  // Print the IR in one piece, other units may be emitted at the same time.
+  {
+    std::string ir;
+    llvm::raw_string_ostream irStream(ir);
+    irStream << *module;
+    std::lock_guard<std::mutex> lock(outputMutex);
+    llvm::outs() << irStream.str();
+    llvm::outs().flush();
+  }
+  // Large modules are split and each part compiled on its own thread.
+  size_t instructions = 0;
+  for (auto &function : *module)
+    for (auto &block : function) instructions += block.size();
+  auto parts = std::min<size_t>(threads, instructions / minPartSize);
+  TimeReport::Phase phase(timeReport, unitName, "emission");
+  if (parts > 1) return emitSplitObject(filename, parts);
+
+  llvm::legacy::PassManager pm;
+
+  std::error_code EC;
+  llvm::raw_fd_ostream dest(filename, EC, llvm::sys::fs::F_None);
+
+  if (EC) {
+    llvm::errs() << "Could not open file: " << EC.message();
+    return false;
+  }
+
+  auto fileType = llvm::TargetMachine::CGFT_ObjectFile;
+
+  if (targetMachine->addPassesToEmitFile(pm, dest, nullptr, fileType)) {
+    llvm::errs() << "TheTargetMachine can't emit a file of this type";
+    return false;
+  }
+
+  pm.run(*module);
+  dest.flush();
+  log("Wrote " + filename);
+  return true;
+}
+
+// SplitModule cuts the optimized module into `parts` modules along the
+// call graph, each of which is then compiled in its own LLVMContext on a
+// thread of its own. The objects are combined into `filename` with a
+// relocatable link, so that the result is a single object as usual. The
+// module is gone afterwards.
+bool CodeGenContext::emitSplitObject(std::string const &filename,
+                                     size_t parts) {
+  auto ld = llvm::sys::findProgramByName("ld");
+  if (!ld) {
+    llvm::errs() << "Could not find ld to link the split object: "
+                 << ld.getError().message() << "\n";
+    return false;
+  }
+
+  std::vector<std::string> partNames;
+  std::vector<std::unique_ptr<llvm::raw_fd_ostream>> partFiles;
+  std::vector<llvm::raw_pwrite_stream *> partStreams;
+  auto removeParts = [&] {
+    partFiles.clear();
+    for (auto &name : partNames) llvm::sys::fs::remove(name);
+  };
+  for (size_t i = 0; i != parts; ++i) {
+    int fd;
+    llvm::SmallString<128> name;
+    if (auto EC = llvm::sys::fs::createTemporaryFile("tiger", "o", fd, name)) {
+      llvm::errs() << "Could not create temporary file: " << EC.message();
+      removeParts();
+      return false;
+    }
+    partNames.push_back(name.str().str());
+    partFiles.push_back(llvm::make_unique<llvm::raw_fd_ostream>(fd, true));
+    partStreams.push_back(partFiles.back().get());
+  }
+
+  // Internal symbols referenced from another part become external hidden
+  // ones, which must not clash with those of other units.
+  for (auto &global : module->global_values())
+    if (global.hasLocalLinkage())
+      global.setName(unitName + "$" + global.getName().str());
+
+  llvm::splitCodeGen(std::move(module), partStreams, {},
+                     [this] {
+                       return std::unique_ptr<llvm::TargetMachine>(
+                           newTargetMachine());
+                     },
+                     llvm::TargetMachine::CGFT_ObjectFile);
+  partFiles.clear();
+
+  std::vector<llvm::StringRef> args{*ld, "-r", "-o", filename};
+  args.insert(args.end(), partNames.begin(), partNames.end());
+  std::string error;
+  auto result = llvm::sys::ExecuteAndWait(*ld, args, llvm::None, {}, 0, 0,
+                                          &error);
+  removeParts();
+  if (result != 0) {
+    llvm::errs() << "Linking " << filename << " failed: " << error << "\n";
+    return false;
+  }
+  log("Wrote " + filename + " in " + std::to_string(parts) + " parts");
+  return true;
+}
+
+int CodeGenContext::runJIT() {
+  // Timings go to stderr so that they don't mix with the program output.
+  auto start = std::chrono::steady_clock::now();
+  TigerJIT jit(std::move(targetMachine));
+  jit.addModule(std::move(module));
+  auto main = jit.findSymbol("main");
+  if (!main) {
+    std::cerr << "JIT: main is not found." << std::endl;
+    return 1;
+  }
+  auto address = main.getAddress();
+  if (!address) {
+    llvm::logAllUnhandledErrors(address.takeError(), llvm::errs(), "JIT: ");
+    return 1;
+  }
+  auto compiled = std::chrono::steady_clock::now();
+  auto mainFunction =
+      reinterpret_cast<std::int64_t (*)()>(static_cast<std::uintptr_t>(*address));
+  auto result = mainFunction();
+  // The program's output is buffered by the runtime linked in here.
+  flush();
+  auto finished = std::chrono::steady_clock::now();
+
+  std::chrono::duration<double, std::milli> compileTime = compiled - start;
+  std::chrono::duration<double, std::milli> runTime = finished - compiled;
+  std::cerr << "JIT compilation took " << compileTime.count() << " ms."
+            << std::endl;
+  std::cerr << "Run took " << runTime.count() << " ms." << std::endl;
+  return static_cast<int>(result);
 }
 
 llvm::Function *CodeGenContext::createIntrinsicFunction(
@@ -25,17 +447,191 @@ llvm::Function *CodeGenContext::createIntrinsicFunction(
   auto functionType = llvm::FunctionType::get(retType, args, false);
   auto function = llvm::Function::Create(
       functionType, llvm::Function::ExternalLinkage, name, module.get());
+  // None of the runtime functions throws.
+  function->setDoesNotThrow();
   functions.push(name, function);
   return function;
 }
 
+// String constants are laid out like the runtime strings: the length
+// followed by the NUL terminated characters, see utils/runtime.h.
+// The strings of the runtime's table are shared by the whole program.
+llvm::Constant *CodeGenContext::emptyString() {
+  auto global = module->getOrInsertGlobal("emptyString", staticStringType);
+  llvm::Constant *indices[] = {builder.getInt32(0), builder.getInt32(1),
+                               builder.getInt32(0)};
+  return llvm::ConstantExpr::getInBoundsGetElementPtr(staticStringType, global,
+                                                      indices);
+}
+
+// The one-character string of `c`, which must be below 256.
+llvm::Value *CodeGenContext::charString(llvm::Value *c) {
+  auto tableType = llvm::ArrayType::get(staticStringType, 256);
+  auto table = module->getOrInsertGlobal("charStrings", tableType);
+  if (auto constant = llvm::dyn_cast<llvm::Constant>(c)) {
+    llvm::Constant *indices[] = {builder.getInt64(0), constant,
+                                 builder.getInt32(1), builder.getInt64(0)};
+    return llvm::ConstantExpr::getInBoundsGetElementPtr(tableType, table,
+                                                        indices);
+  }
+  llvm::Value *indices[] = {builder.getInt64(0), c, builder.getInt32(1),
+                            builder.getInt64(0)};
+  return builder.CreateInBoundsGEP(table, indices, "charString");
+}
+
+llvm::Constant *CodeGenContext::createString(llvm::StringRef value) {
+  if (value.empty()) return emptyString();
+  if (value.size() == 1)
+    return llvm::cast<llvm::Constant>(
+        charString(builder.getInt64(static_cast<unsigned char>(value[0]))));
+  auto &string = strings[value];
+  if (string) return string;
+  auto literal = llvm::ConstantStruct::getAnon(
+      {llvm::ConstantInt::get(intType, value.size()),
+       llvm::ConstantDataArray::getString(context, value)});
+  auto global = new llvm::GlobalVariable(*module, literal->getType(), true,
+                                         llvm::GlobalValue::PrivateLinkage,
+                                         literal, "str");
+  global->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+  global->setAlignment(8);
+  llvm::Constant *indices[] = {builder.getInt32(0), builder.getInt32(1),
+                               builder.getInt32(0)};
+  string = llvm::ConstantExpr::getInBoundsGetElementPtr(literal->getType(),
+                                                        global, indices);
+  return string;
+}
+
+// Bump allocate `count` elements of `elementSize` bytes in the allocation area
+// of the runtime heap inline, calling `slowPath` with `args` only when they
+// do not fit. An array is preceded by its length and the result points at
+// its elements. With `zeroed` the fast path clears the elements, `slowPath`
+// must return cleared memory itself.
+llvm::Value *CodeGenContext::allocate(llvm::Value *count,
+                                      std::uint64_t elementSize,
+                                      llvm::Function *slowPath,
+                                      std::vector<llvm::Value *> const &args,
+                                      bool isArray, bool zeroed) {
+  auto function = builder.GetInsertBlock()->getParent();
+  auto fastBB = llvm::BasicBlock::Create(context, "alloc.fast", function);
+  auto slowBB = llvm::BasicBlock::Create(context, "alloc.slow", function);
+  auto mergeBB = llvm::BasicBlock::Create(context, "alloc.end", function);
+
+  auto areaType = allocationArea->getValueType();
+  auto bumpPtr = builder.CreateStructGEP(areaType, allocationArea, 0);
+  auto bump = builder.CreateLoad(bumpPtr, "bump");
+  auto limit = builder.CreateLoad(
+      builder.CreateStructGEP(areaType, allocationArea, 1), "limit");
+  auto available = builder.CreateSub(builder.CreatePtrToInt(limit, intType),
+                                     builder.CreatePtrToInt(bump, intType),
+                                     "available");
+  auto elementBytes = builder.CreateMul(count, builder.getInt64(elementSize));
+  auto bytes = isArray ? builder.CreateAdd(elementBytes, builder.getInt64(8))
+                       : elementBytes;
+  auto total = builder.CreateAdd(
+      builder.CreateAnd(builder.CreateAdd(bytes, builder.getInt64(7)),
+                        builder.getInt64(~7ull)),
+      builder.getInt64(8), "total");
+  auto fits = builder.CreateICmpULE(total, available, "fits");
+  // Keep the size of huge arrays from wrapping around. Negative counts are
+  // huge as unsigned and go to the slow path, which reports them. Constant
+  // counts below 2^32 cannot wrap.
+  auto constantCount = llvm::dyn_cast<llvm::ConstantInt>(count);
+  if (!constantCount || !constantCount->getValue().ult(1ull << 32))
+    fits = builder.CreateAnd(
+        fits, builder.CreateICmpULE(
+                  count, builder.CreateUDiv(available,
+                                            builder.getInt64(elementSize))));
+  builder.CreateCondBr(fits, fastBB, slowBB,
+                       llvm::MDBuilder(context).createBranchWeights(2000, 1));
+
+  builder.SetInsertPoint(fastBB);
+  builder.CreateStore(
+      total, builder.CreateBitCast(bump, llvm::PointerType::getUnqual(intType)));
+  builder.CreateStore(builder.CreateGEP(bump, total), bumpPtr);
+  auto object = builder.CreateGEP(bump, builder.getInt64(8), "object");
+  if (isArray) {
+    builder.CreateStore(count, builder.CreateBitCast(
+                                   object, llvm::PointerType::getUnqual(intType)));
+    object = builder.CreateGEP(object, builder.getInt64(8), "elements");
+  }
+  if (zeroed)
+    builder.CreateMemSet(object, builder.getInt8(0), elementBytes, 8);
+  builder.CreateBr(mergeBB);
+
+  builder.SetInsertPoint(slowBB);
+  auto slow = builder.CreateCall(slowPath, args, "alloca");
+  builder.CreateBr(mergeBB);
+
+  builder.SetInsertPoint(mergeBB);
+  auto PN = builder.CreatePHI(builder.getInt8PtrTy(), 2, "alloc");
+  PN->addIncoming(object, fastBB);
+  PN->addIncoming(slow, slowBB);
+  return PN;
+}
+
+// Trap on subscripts outside [0, length). The length is a plain load: the
+// inline allocation stores it, and the collector reuses the memory, so it is
+// not invariant. LICM still hoists it out of loops that do not allocate, and
+// the range check elimination pass can then drop the check.
+void CodeGenContext::checkBounds(llvm::Value *array, llvm::Value *index) {
+  auto function = builder.GetInsertBlock()->getParent();
+  auto failBB = llvm::BasicBlock::Create(context, "outofbounds", function);
+  auto okBB = llvm::BasicBlock::Create(context, "inbounds", function);
+  auto lengthPtr = builder.CreateGEP(
+      builder.CreateBitCast(array, llvm::PointerType::getUnqual(intType)),
+      builder.getInt64(-1), "lengthPtr");
+  auto length = builder.CreateLoad(lengthPtr, "length");
+  auto inBounds = builder.CreateICmpULT(index, length, "inbounds");
+  builder.CreateCondBr(inBounds, okBB, failBB,
+                       llvm::MDBuilder(context).createBranchWeights(2000, 1));
+  builder.SetInsertPoint(failBB);
+  builder.CreateCall(indexOutOfBoundsFunction,
+                     std::vector<llvm::Value *>{index, length});
+  builder.CreateUnreachable();
+  builder.SetInsertPoint(okBB);
+}
+
 llvm::Value *CodeGenContext::strcmp(llvm::Value *a, llvm::Value *b) {
   return builder.CreateCall(strCmpFunction, std::vector<llvm::Value *>{a, b},
                             "strcmp");
 }
 
+// Tiger division truncates towards zero like sdiv, but dividing by zero is a
+// runtime error instead of undefined behaviour, and dividing by -1 negates
+// with wrap around, so that the smallest integer divided by -1 is itself.
+// Other constant divisors need no check, which leaves them to the
+// magic-number lowering.
+llvm::Value *CodeGenContext::sdiv(llvm::Value *a, llvm::Value *b) {
+  auto divisor = llvm::dyn_cast<llvm::ConstantInt>(b);
+  if (divisor && divisor->isMinusOne())
+    return builder.CreateSub(zero, a, "negtmp");
+  if (!divisor || divisor->isZero()) {
+    auto function = builder.GetInsertBlock()->getParent();
+    auto errorBB = llvm::BasicBlock::Create(context, "divzero", function);
+    auto divBB = llvm::BasicBlock::Create(context, "div", function);
+    auto isZero = builder.CreateICmpEQ(b, zero, "iszero");
+    builder.CreateCondBr(isZero, errorBB, divBB,
+                         llvm::MDBuilder(context).createBranchWeights(1, 2000));
+    builder.SetInsertPoint(errorBB);
+    builder.CreateCall(divisionByZeroFunction);
+    builder.CreateUnreachable();
+    builder.SetInsertPoint(divBB);
+  }
+  if (divisor) return builder.CreateSDiv(a, b, "divtmp");
+  // sdiv never sees -1, selects keep the common case free of branches.
+  auto minusOne = llvm::ConstantInt::getSigned(intType, -1);
+  auto isMinusOne = builder.CreateICmpEQ(b, minusOne, "isminusone");
+  auto quotient = builder.CreateSDiv(
+      a, builder.CreateSelect(isMinusOne, one, b, "divisor"), "divtmp");
+  return builder.CreateSelect(isMinusOne, builder.CreateSub(zero, a, "negtmp"),
+                              quotient, "quotient");
+}
+
 llvm::Value *CodeGenContext::checkStore(llvm::Value *val, llvm::Value *ptr) {
-  val = convertNil(val, ptr);
+  // nil takes the type of the variable or field it is stored in.
+  val = convertNil(
+      val, llvm::Constant::getNullValue(getElementType(ptr->getType())));
+  if (!val) return nullptr;
   return builder.CreateStore(val, ptr);
 }
 
@@ -66,6 +662,25 @@ llvm::AllocaInst *CodeGenContext::createEntryBlockAlloca(
   return TmpB.CreateAlloca(type, size, name.c_str());
 }
 
+// Frame pointer of the enclosing function at `level`. Every ancestor frame is
+// loaded at most once per function, in its entry block, so that accesses to
+// outer variables and calls to outer functions do not walk the static links
+// again, in particular not on every iteration of a loop.
+llvm::Value *CodeGenContext::frameOf(size_t level) {
+  auto distance = currentLevel - level;
+  auto &entry = builder.GetInsertBlock()->getParent()->getEntryBlock();
+  while (frames.size() <= distance) {
+    auto frame = frames.back();
+    llvm::IRBuilder<> entryBuilder(&entry, entry.begin());
+    if (auto instruction = llvm::dyn_cast<llvm::Instruction>(frame))
+      entryBuilder.SetInsertPoint(&entry, ++instruction->getIterator());
+    auto link = entryBuilder.CreateStructGEP(staticLink[frames.size() - 1],
+                                             frame, 0, "staticLink");
+    frames.push_back(entryBuilder.CreateLoad(link, "frame"));
+  }
+  return frames[distance];
+}
+
 llvm::Type *CodeGenContext::getElementType(llvm::Type *type) {
   return llvm::cast<llvm::PointerType>(type)->getElementType();
 }
@@ -103,15 +718,15 @@ llvm::Type *CodeGenContext::logErrorT(std::string const &msg) {
   return nullptr;
 }
 
-llvm::Type *CodeGenContext::typeOf(std::string const &name,
-                                   std::set<std::string> &parentName) {
+llvm::Type *CodeGenContext::typeOf(Symbol name,
+                                   std::set<Symbol> &parentName) {
   if (auto type = types[name]) return type;
   auto typeDec = typeDecs[name];
-  if (!typeDec) return logErrorT(name + " is not a type");
+  if (!typeDec) return logErrorT(name.str() + " is not a type");
   return typeDec->traverse(parentName, *this);
 }
 
-llvm::Type *CodeGenContext::typeOf(const std::string &name) {
-  std::set<std::string> parentName;
+llvm::Type *CodeGenContext::typeOf(Symbol name) {
+  std::set<Symbol> parentName;
   return typeOf(name, parentName);
 }
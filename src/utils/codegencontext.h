@@ -1,6 +1,7 @@
 #ifndef CODEGENCONTEXT_H
 #define CODEGENCONTEXT_H
 #include <AST/ast.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/IR/Constant.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/IRBuilder.h>
@@ -18,9 +19,16 @@
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Target/TargetOptions.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include "utils/arena.h"
+#include "utils/interface.h"
+#include "utils/symbol.h"
 #include "utils/symboltable.h"
+#include "utils/timereport.h"
 
+#include <functional>
 #include <set>
+#include <unordered_map>
 
 namespace AST {
 class Type;
@@ -31,6 +39,8 @@ class FunctionDec;
 class CodeGenContext {
  public:
   bool hasError{false};
+  // Owner of the AST, also used for the VarDecs created by traverse.
+  Arena *arena{nullptr};
   llvm::LLVMContext context;
   llvm::IRBuilder<> builder{context};
   std::unique_ptr<llvm::Module> module{
@@ -43,8 +53,36 @@ class CodeGenContext {
   // TODO
   // SymbolTable<std::string> externalFunctions;
   std::deque<llvm::StructType *> staticLink;
-  llvm::AllocaInst *currentFrame;
+  llvm::Value *currentFrame;
+  // Frame pointers of the current function and its ancestors, by distance.
+  std::vector<llvm::Value *> frames;
   size_t currentLevel = 0;
+  // The compilation unit. A program defines main; a library defines
+  // <unit>.init, which runs its body, and <unit>.<function> for each
+  // exported function, and keeps its outermost variables in a global frame.
+  std::string unitName{"main"};
+  bool library = false;
+  // Interfaces of the libraries the unit is compiled against, in the order
+  // main initializes them.
+  std::vector<Interface const *> imports;
+  // Functions declared at the outermost level, found by traverse.
+  std::vector<AST::FunctionDec *> unitFunctions;
+  // -O level used by optimize().
+  unsigned optLevel = 0;
+  // Check array subscripts at run time (-fbounds-check).
+  bool boundsCheck = false;
+  // Target selection, "native" selects the host CPU and its features.
+  std::string cpu{"generic"};
+  std::vector<std::string> features;
+  llvm::Optional<llvm::Reloc::Model> relocModel;
+  llvm::Optional<llvm::CodeModel::Model> codeModel;
+  std::unique_ptr<llvm::TargetMachine> targetMachine;
+  // Threads emitObject may use. Modules are only split when every part gets
+  // at least minPartSize instructions.
+  unsigned threads = 1;
+  static constexpr size_t minPartSize = 20000;
+  // Phase timings for -ftime-report, if given.
+  TimeReport *timeReport{nullptr};
 
   llvm::Type *intType{llvm::Type::getInt64Ty(context)};
   llvm::Type *voidType{llvm::Type::getVoidTy(context)};
@@ -57,11 +95,33 @@ class CodeGenContext {
       "allocaArray",
       {llvm::Type::getInt64Ty(context), llvm::Type::getInt64Ty(context)},
       llvm::Type::getInt8PtrTy(context))};
+  llvm::Function *allocaZeroedArrayFunction{createIntrinsicFunction(
+      "allocaZeroedArray",
+      {llvm::Type::getInt64Ty(context), llvm::Type::getInt64Ty(context)},
+      llvm::Type::getInt8PtrTy(context))};
   llvm::Function *allocaRecordFunction = {
       createIntrinsicFunction("allocaRecord", {llvm::Type::getInt64Ty(context)},
                               llvm::Type::getInt8PtrTy(context))};
   llvm::Function *strCmpFunction = {
       createIntrinsicFunction("strcmp_", {stringType, stringType}, intType)};
+  llvm::Function *divisionByZeroFunction = {
+      createIntrinsicFunction("divisionByZero", {}, voidType)};
+  llvm::Function *indexOutOfBoundsFunction = {createIntrinsicFunction(
+      "indexOutOfBounds", {intType, intType}, voidType)};
+  // { i8* bump, i8* limit } of the runtime heap, see utils/runtime.h.
+  llvm::GlobalVariable *allocationArea;
+  // { i64 length, [8 x i8] chars } of the preallocated runtime strings.
+  llvm::StructType *staticStringType{llvm::StructType::create(
+      context, {intType, llvm::ArrayType::get(builder.getInt8Ty(), 8)},
+      "StaticString")};
+  // String literals of the module by value, each is emitted once.
+  llvm::StringMap<llvm::Constant *> strings;
+  // Calls of runtime functions that CallExp expands inline instead, set up
+  // by intrinsic(). An expansion returns nullptr to have the call made.
+  std::unordered_map<llvm::Function *,
+                     std::function<llvm::Value *(
+                         std::vector<llvm::Value *> const &)>>
+      inlineCalls;
   std::stack<
       std::tuple<llvm::BasicBlock * /*next*/, llvm::BasicBlock * /*after*/>>
       loopStack;
@@ -75,6 +135,8 @@ class CodeGenContext {
                                            const std::string &name,
                                            llvm::Value *size = nullptr);
 
+  llvm::Value *frameOf(size_t level);
+
   llvm::Type *getElementType(llvm::Type *type);
 
   bool isNil(llvm::Type *exp);
@@ -86,12 +148,31 @@ class CodeGenContext {
                                           std::vector<llvm::Type *> const &args,
                                           llvm::Type *retType);
   llvm::Value *strcmp(llvm::Value *a, llvm::Value *b);
+  llvm::Constant *emptyString();
+  llvm::Value *charString(llvm::Value *c);
+  llvm::Constant *createString(llvm::StringRef value);
+  llvm::Value *allocate(llvm::Value *count, std::uint64_t elementSize,
+                        llvm::Function *slowPath,
+                        std::vector<llvm::Value *> const &args,
+                        bool isArray = false, bool zeroed = false);
+  void checkBounds(llvm::Value *array, llvm::Value *index);
+  llvm::Value *sdiv(llvm::Value *a, llvm::Value *b);
   void intrinsic();
+  void importFunctions();
+  std::vector<AST::FunctionDec *> exportedFunctions();
+  Interface exports();
+  void exportFunctions(llvm::Value *frame);
+  llvm::TargetMachine *newTargetMachine();
+  llvm::TargetMachine *createTargetMachine();
+  void optimize(llvm::TargetMachine *targetMachine);
+  bool emitObject(std::string const &filename);
+  bool emitSplitObject(std::string const &filename, size_t parts);
+  int runJIT();
+  void log(std::string const &line);
   llvm::Type *logErrorT(std::string const &msg);
 
-  llvm::Type *typeOf(std::string const &name,
-                     std::set<std::string> &parentName);
-  llvm::Type *typeOf(const std::string &name);
+  llvm::Type *typeOf(Symbol name, std::set<Symbol> &parentName);
+  llvm::Type *typeOf(Symbol name);
   CodeGenContext();
 };
 
@@ -0,0 +1,88 @@
+#include "interface.h"
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+static const char *magic = "tiger-interface 1";
+
+static bool isType(llvm::StringRef word) {
+  return word == "int" || word == "string";
+}
+
+std::string Interface::signature() const {
+  std::string text;
+  llvm::raw_string_ostream out(text);
+  for (auto &function : functions) {
+    out << "function " << function.name;
+    for (auto &param : function.params) out << ' ' << param;
+    out << " :";
+    if (!function.result.empty()) out << ' ' << function.result;
+    out << '\n';
+  }
+  return out.str();
+}
+
+bool Interface::write(std::string const &filename) const {
+  std::error_code EC;
+  llvm::raw_fd_ostream out(filename, EC, llvm::sys::fs::F_Text);
+  if (EC) {
+    llvm::errs() << "Could not open file: " << EC.message() << "\n";
+    return false;
+  }
+  out << magic << '\n'
+      << "unit " << unit << '\n'
+      << "source " << sourceHash << '\n'
+      << "object " << objectHash << '\n'
+      << signature();
+  return true;
+}
+
+bool Interface::read(std::string const &filename) {
+  auto buffer = llvm::MemoryBuffer::getFile(filename);
+  if (!buffer) return false;
+  llvm::SmallVector<llvm::StringRef, 8> lines;
+  (*buffer)->getBuffer().split(lines, '\n', -1, false);
+  if (lines.empty() || lines.front() != magic) return false;
+  *this = Interface();
+  for (auto line : llvm::makeArrayRef(lines).drop_front()) {
+    llvm::SmallVector<llvm::StringRef, 8> words;
+    line.split(words, ' ', -1, false);
+    if (words.size() < 2) return false;
+    if (words[0] == "unit") {
+      unit = words[1].str();
+    } else if (words[0] == "source") {
+      sourceHash = words[1].str();
+    } else if (words[0] == "object") {
+      objectHash = words[1].str();
+    } else if (words[0] == "function") {
+      Function function{words[1].str(), {}, {}};
+      size_t i = 2;
+      for (; i < words.size() && isType(words[i]); ++i)
+        function.params.push_back(words[i].str());
+      if (i == words.size() || words[i] != ":") return false;
+      if (i + 1 < words.size()) {
+        if (!isType(words[i + 1])) return false;
+        function.result = words[i + 1].str();
+      }
+      functions.push_back(std::move(function));
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string hashOf(std::vector<llvm::StringRef> const &parts) {
+  llvm::MD5 md5;
+  for (auto part : parts) {
+    uint64_t size = part.size();
+    md5.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<uint8_t *>(&size),
+                                       sizeof(size)));
+    md5.update(part);
+  }
+  llvm::MD5::MD5Result result;
+  md5.final(result);
+  return result.digest().str().str();
+}
@@ -0,0 +1,45 @@
+#ifndef INTERFACE_H
+#define INTERFACE_H
+
+#include <llvm/ADT/StringRef.h>
+#include <string>
+#include <vector>
+
+// What other compilation units see of a unit: the functions it exports,
+// declared at the outermost level of the unit with int and string
+// parameters and results only. It is written next to the object file as
+// <unit>.tgi together with the hashes that tell whether the unit has to be
+// compiled again:
+//
+//   tiger-interface 1
+//   unit <name>
+//   source <md5 of the source>
+//   object <md5 of the source, the options and the imported interfaces>
+//   function <name> <parameter type>... : [<result type>]
+//
+// The interface only depends on the source, the object also on everything
+// that is imported.
+struct Interface {
+  struct Function {
+    std::string name;
+    std::vector<std::string> params;
+    // Empty for procedures.
+    std::string result;
+  };
+
+  std::string unit;
+  std::string sourceHash;
+  std::string objectHash;
+  std::vector<Function> functions;
+
+  // The exported functions in the file format, which is what importers hash.
+  std::string signature() const;
+  bool write(std::string const &filename) const;
+  // Returns false if the file is missing or not an interface file.
+  bool read(std::string const &filename);
+};
+
+// Hex MD5 of the concatenation of `parts`, each preceded by its length.
+std::string hashOf(std::vector<llvm::StringRef> const &parts);
+
+#endif  // INTERFACE_H
@@ -0,0 +1,88 @@
+#include "jit.h"
+#include <llvm/ExecutionEngine/RTDyldMemoryManager.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/IR/Mangler.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/raw_ostream.h>
+#include <utils/runtime.h>
+
+template <typename T>
+static llvm::JITTargetAddress addressOf(T *function) {
+  return static_cast<llvm::JITTargetAddress>(
+      reinterpret_cast<std::uintptr_t>(function));
+}
+
+TigerJIT::TigerJIT(std::unique_ptr<llvm::TargetMachine> targetMachine)
+    : resolver_(llvm::orc::createLegacyLookupResolver(
+          session_,
+          [this](const std::string &name) { return findMangledSymbol(name); },
+          [](llvm::Error error) {
+            llvm::cantFail(std::move(error), "lookupFlags failed");
+          })),
+      targetMachine_(std::move(targetMachine)),
+      dataLayout_(targetMachine_->createDataLayout()),
+      objectLayer_(session_,
+                   [this](llvm::orc::VModuleKey) {
+                     return ObjectLayer::Resources{
+                         std::make_shared<llvm::SectionMemoryManager>(),
+                         resolver_};
+                   }),
+      compileLayer_(objectLayer_, llvm::orc::SimpleCompiler(*targetMachine_)) {
+  llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+  runtimeSymbols_[mangle("print")] = addressOf(print);
+  runtimeSymbols_[mangle("printd")] = addressOf(printd);
+  runtimeSymbols_[mangle("allocaRecord")] = addressOf(allocaRecord);
+  runtimeSymbols_[mangle("allocaArray")] = addressOf(allocaArray);
+  runtimeSymbols_[mangle("allocaZeroedArray")] = addressOf(allocaZeroedArray);
+  runtimeSymbols_[mangle("allocationArea")] = addressOf(&allocationArea);
+  runtimeSymbols_[mangle("charStrings")] = addressOf(&charStrings);
+  runtimeSymbols_[mangle("emptyString")] = addressOf(&emptyString);
+  runtimeSymbols_[mangle("addRoot")] = addressOf(addRoot);
+  runtimeSymbols_[mangle("flush")] = addressOf(flush);
+  runtimeSymbols_[mangle("getchar_")] = addressOf(getchar_);
+  runtimeSymbols_[mangle("ord")] = addressOf(ord);
+  runtimeSymbols_[mangle("chr")] = addressOf(chr);
+  runtimeSymbols_[mangle("size")] = addressOf(size);
+  runtimeSymbols_[mangle("substring")] = addressOf(substring);
+  runtimeSymbols_[mangle("concat")] = addressOf(concat);
+  runtimeSymbols_[mangle("not_")] = addressOf(not_);
+  runtimeSymbols_[mangle("exit_")] = addressOf(exit_);
+  runtimeSymbols_[mangle("strcmp_")] = addressOf(strcmp_);
+  runtimeSymbols_[mangle("divisionByZero")] = addressOf(divisionByZero);
+  runtimeSymbols_[mangle("indexOutOfBounds")] = addressOf(indexOutOfBounds);
+}
+
+llvm::orc::VModuleKey TigerJIT::addModule(
+    std::unique_ptr<llvm::Module> module) {
+  auto key = session_.allocateVModule();
+  llvm::cantFail(compileLayer_.addModule(key, std::move(module)));
+  moduleKeys_.push_back(key);
+  return key;
+}
+
+llvm::JITSymbol TigerJIT::findSymbol(std::string const &name) {
+  return findMangledSymbol(mangle(name));
+}
+
+std::string TigerJIT::mangle(std::string const &name) {
+  std::string mangledName;
+  {
+    llvm::raw_string_ostream mangledNameStream(mangledName);
+    llvm::Mangler::getNameWithPrefix(mangledNameStream, name, dataLayout_);
+  }
+  return mangledName;
+}
+
+llvm::JITSymbol TigerJIT::findMangledSymbol(std::string const &name) {
+  for (auto key = moduleKeys_.rbegin(); key != moduleKeys_.rend(); ++key)
+    if (auto symbol = compileLayer_.findSymbolIn(*key, name, false))
+      return symbol;
+  auto runtime = runtimeSymbols_.find(name);
+  if (runtime != runtimeSymbols_.end())
+    return llvm::JITSymbol(runtime->second, llvm::JITSymbolFlags::Exported);
+  // Anything else (memcpy, memset, ...) comes from the host process.
+  if (auto address =
+          llvm::RTDyldMemoryManager::getSymbolAddressInProcess(name))
+    return llvm::JITSymbol(address, llvm::JITSymbolFlags::Exported);
+  return nullptr;
+}
@@ -0,0 +1,43 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ExecutionEngine/JITSymbol.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/Core.h>
+#include <llvm/ExecutionEngine/Orc/IRCompileLayer.h>
+#include <llvm/ExecutionEngine/Orc/Legacy.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// In-process ORC JIT. Symbols are looked up in the compiled modules first,
+// then in the runtime library linked into the compiler, then in the process.
+class TigerJIT {
+  using ObjectLayer = llvm::orc::RTDyldObjectLinkingLayer;
+  using CompileLayer = llvm::orc::IRCompileLayer<ObjectLayer,
+                                                 llvm::orc::SimpleCompiler>;
+
+  llvm::orc::ExecutionSession session_;
+  std::shared_ptr<llvm::orc::SymbolResolver> resolver_;
+  std::unique_ptr<llvm::TargetMachine> targetMachine_;
+  const llvm::DataLayout dataLayout_;
+  ObjectLayer objectLayer_;
+  CompileLayer compileLayer_;
+  std::vector<llvm::orc::VModuleKey> moduleKeys_;
+  llvm::StringMap<llvm::JITTargetAddress> runtimeSymbols_;
+
+  std::string mangle(std::string const &name);
+  llvm::JITSymbol findMangledSymbol(std::string const &name);
+
+ public:
+  TigerJIT(std::unique_ptr<llvm::TargetMachine> targetMachine);
+  llvm::orc::VModuleKey addModule(std::unique_ptr<llvm::Module> module);
+  llvm::JITSymbol findSymbol(std::string const &name);
+};
+
+#endif  // JIT_H
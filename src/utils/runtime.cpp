@@ -1,71 +1,562 @@
+#include "runtime.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <map>
+#include <vector>
+
+AllocationArea allocationArea{nullptr, nullptr};
+
+#define CHAR_STRING(c) \
+  { 1, { char(c) } }
+#define CHAR_STRINGS_4(c) \
+  CHAR_STRING(c), CHAR_STRING(c + 1), CHAR_STRING(c + 2), CHAR_STRING(c + 3)
+#define CHAR_STRINGS_16(c)                                         \
+  CHAR_STRINGS_4(c), CHAR_STRINGS_4(c + 4), CHAR_STRINGS_4(c + 8), \
+      CHAR_STRINGS_4(c + 12)
+#define CHAR_STRINGS_64(c)                                             \
+  CHAR_STRINGS_16(c), CHAR_STRINGS_16(c + 16), CHAR_STRINGS_16(c + 32), \
+      CHAR_STRINGS_16(c + 48)
+StaticString charStrings[256] = {CHAR_STRINGS_64(0), CHAR_STRINGS_64(64),
+                                 CHAR_STRINGS_64(128), CHAR_STRINGS_64(192)};
+StaticString emptyString = {0, {}};
+
+namespace {
+// Garbage collected heap of Tiger programs.
+//
+// Small objects are bump allocated in 1 MiB blocks, first into fresh blocks
+// and, after a collection, into the holes left by dead objects. The hole
+// being filled is allocationArea, where generated code allocates inline.
+// Large objects get a malloc'ed block of their own. Every object is preceded
+// by a header word holding its size and flags; free space is covered by
+// filler headers, so that a block can be walked object by object.
+//
+// Collection is mark & sweep and conservative: every word of the machine
+// stack and of the callee-saved registers that looks like a pointer into an
+// object (interior pointers included) marks it, and so does every word of
+// a marked object unless it holds no pointers (strings). That finds the
+// static-link frames, the mem2reg promoted locals and the temporaries the
+// optimizer keeps in registers without any help from the generated code,
+// and objects are never moved. The only memory outside the stack that holds
+// pointers are the global frames of library units, registered by addRoot.
+class Heap {
+  static constexpr std::size_t blockSize = 1u << 20;
+  static constexpr std::size_t granule = sizeof(std::uint64_t);
+  static constexpr std::size_t largeSize = blockSize / 4;
+  // Smaller holes are not worth bump allocating into.
+  static constexpr std::size_t minHole = 256;
+  static constexpr std::size_t minThreshold = 4u << 20;
+
+  static constexpr std::uint64_t marked = 1;
+  static constexpr std::uint64_t filler = 2;
+  static constexpr std::uint64_t noScan = 4;
+  static constexpr std::uint64_t flags = 7;
+
+  struct Block {
+    char *start;
+    char *end;
+    bool large;
+    // One bit per granule, set where an object starts.
+    std::vector<std::uint64_t> starts;
+  };
+  struct Hole {
+    Block *block;
+    char *start;
+    char *end;
+  };
+
+  std::map<std::uintptr_t, Block *> blocks_;
+  std::uintptr_t low_{UINTPTR_MAX}, high_{0};
+  std::vector<Hole> holes_;
+  std::size_t nextHole_{0};
+  Block *current_{nullptr};
+  std::vector<std::pair<char *, char *>> roots_;
+  // Start of the part of allocationArea that has been allocated since the
+  // last refill.
+  char *filled_{nullptr};
+  std::size_t allocated_{0};
+  std::size_t threshold_{minThreshold};
+  std::vector<char *> markStack_;
+  char *stackTop_{nullptr};
+
+  static std::uint64_t &header(char *object) {
+    return *reinterpret_cast<std::uint64_t *>(object);
+  }
+  static std::size_t sizeOf(char *object) { return header(object) & ~flags; }
+
+  static void setFiller(char *start, char *end) {
+    if (start != end) header(start) = std::uint64_t(end - start) | filler;
+  }
+
+  static std::size_t granuleOf(Block *block, char *address) {
+    return std::size_t(address - block->start) / granule;
+  }
+  static void setStart(Block *block, char *object, bool value) {
+    auto index = granuleOf(block, object);
+    auto bit = std::uint64_t(1) << (index % 64);
+    if (value)
+      block->starts[index / 64] |= bit;
+    else
+      block->starts[index / 64] &= ~bit;
+  }
+
+  Block *addBlock(std::size_t size, bool large, bool zeroed = false) {
+    // calloc hands out fresh pages without touching them.
+    auto start = static_cast<char *>(zeroed ? calloc(1, size) : malloc(size));
+    if (!start) {
+      std::cerr << "Out of memory" << std::endl;
+      exit(1);
+    }
+    auto block = new Block{start, start + size, large, {}};
+    if (!large) block->starts.resize(blockSize / granule / 64);
+    blocks_.emplace(std::uintptr_t(start), block);
+    low_ = std::min(low_, std::uintptr_t(start));
+    high_ = std::max(high_, std::uintptr_t(start + size));
+    return block;
+  }
+
+  void removeBlock(Block *block) {
+    blocks_.erase(std::uintptr_t(block->start));
+    free(block->start);
+    delete block;
+  }
+
+  // Give up the rest of the current hole. Objects allocated in it, inline
+  // or not, only get their start bits here.
+  void retire() {
+    auto &area = allocationArea;
+    for (auto object = filled_; object != area.bump; object += sizeOf(object))
+      setStart(current_, object, true);
+    allocated_ += std::size_t(area.bump - filled_);
+    setFiller(area.bump, area.limit);
+    area.bump = area.limit = filled_ = nullptr;
+  }
+
+  void setArea(char *start, char *end) {
+    allocationArea.bump = filled_ = start;
+    allocationArea.limit = end;
+  }
+
+  void refill(std::size_t size) {
+    retire();
+    if (allocated_ >= threshold_) collect();
+    while (nextHole_ != holes_.size()) {
+      auto &hole = holes_[nextHole_++];
+      if (std::size_t(hole.end - hole.start) >= size) {
+        current_ = hole.block;
+        setArea(hole.start, hole.end);
+        return;
+      }
+    }
+    current_ = addBlock(blockSize, false);
+    setArea(current_->start, current_->end);
+  }
+
+  char *allocateLarge(std::size_t size, std::uint64_t flag, bool zeroed) {
+    if (allocated_ >= threshold_) {
+      retire();
+      collect();
+    }
+    auto block = addBlock(size, true, zeroed);
+    header(block->start) = size | flag;
+    allocated_ += size;
+    return block->start + granule;
+  }
+
+  // The object containing `address`, if any. No pointer of the program
+  // points at a header, so an address right past the end of an object (an
+  // empty array, a loop pointer) is taken to belong to it.
+  char *find(std::uintptr_t address) {
+    --address;
+    if (address < low_ || address >= high_) return nullptr;
+    auto it = blocks_.upper_bound(address);
+    if (it == blocks_.begin()) return nullptr;
+    auto block = (--it)->second;
+    auto pointer = reinterpret_cast<char *>(address);
+    if (pointer >= block->end) return nullptr;
+    if (block->large) return block->start;
+    auto index = granuleOf(block, pointer);
+    auto word = index / 64;
+    auto bits = block->starts[word] &
+                (~std::uint64_t(0) >> (63 - index % 64));
+    while (!bits) {
+      if (word == 0) return nullptr;
+      bits = block->starts[--word];
+    }
+    auto object = block->start +
+                  (word * 64 + 63 - __builtin_clzll(bits)) * granule;
+    return pointer < object + sizeOf(object) ? object : nullptr;
+  }
+
+  void mark(std::uintptr_t address) {
+    auto object = find(address);
+    if (!object || (header(object) & marked)) return;
+    header(object) |= marked;
+    if (!(header(object) & noScan)) markStack_.push_back(object);
+  }
+
+  // Stack scanning reads other frames' memory on purpose.
+  __attribute__((no_sanitize("address"))) void scan(char *start, char *end) {
+    for (auto word = reinterpret_cast<std::uintptr_t *>(start);
+         word + 1 <= reinterpret_cast<std::uintptr_t *>(end); ++word)
+      mark(*word);
+  }
+
+  char *stackTop() {
+    if (!stackTop_) {
+      pthread_attr_t attributes;
+      void *stack;
+      std::size_t size;
+      pthread_getattr_np(pthread_self(), &attributes);
+      pthread_attr_getstack(&attributes, &stack, &size);
+      pthread_attr_destroy(&attributes);
+      stackTop_ = static_cast<char *>(stack) + size;
+    }
+    return stackTop_;
+  }
+
+  // Kept out of line so that its frame, which holds the callee-saved
+  // registers, is below every frame of the Tiger program. setjmp is no use
+  // here: glibc mangles the frame pointer it saves.
+  __attribute__((noinline)) void markStack() {
+    __builtin_unwind_init();
+    char marker;
+    auto bottom = reinterpret_cast<std::uintptr_t>(&marker) &
+                  ~std::uintptr_t(granule - 1);
+    scan(reinterpret_cast<char *>(bottom), stackTop());
+    for (auto &root : roots_) scan(root.first, root.second);
+    while (!markStack_.empty()) {
+      auto object = markStack_.back();
+      markStack_.pop_back();
+      scan(object + granule, object + sizeOf(object));
+    }
+  }
+
+  // Turn [start, end) into one filler and remember it if it is large enough.
+  void addHole(Block *block, char *start, char *end) {
+    setFiller(start, end);
+    if (std::size_t(end - start) >= minHole)
+      holes_.push_back({block, start, end});
+  }
+
+  std::size_t sweep(Block *block) {
+    std::size_t live = 0;
+    char *hole = nullptr;
+    auto holes = holes_.size();
+    for (auto object = block->start; object != block->end;) {
+      auto size = sizeOf(object);
+      if (header(object) & marked) {
+        header(object) &= ~marked;
+        live += size;
+        if (hole) addHole(block, hole, object);
+        hole = nullptr;
+      } else {
+        if (!(header(object) & filler)) setStart(block, object, false);
+        if (!hole) hole = object;
+      }
+      object += size;
+    }
+    if (hole) addHole(block, hole, block->end);
+    // Empty blocks are handed out again by collect().
+    if (!live) holes_.resize(holes);
+    return live;
+  }
+
+  void collect() {
+    markStack();
+    holes_.clear();
+    nextHole_ = 0;
+    std::size_t live = 0;
+    std::vector<Block *> empty;
+    for (auto it = blocks_.begin(); it != blocks_.end();) {
+      auto block = (it++)->second;
+      if (block->large) {
+        if (header(block->start) & marked) {
+          header(block->start) &= ~marked;
+          live += sizeOf(block->start);
+        } else {
+          removeBlock(block);
+        }
+        continue;
+      }
+      auto blockLive = sweep(block);
+      if (!blockLive) empty.push_back(block);
+      live += blockLive;
+    }
+    allocated_ = 0;
+    threshold_ = std::max(minThreshold, live);
+    // Keep the empty blocks the program is going to fill before the next
+    // collection anyway, hand the others back to the system.
+    auto keep = threshold_ / blockSize;
+    for (auto block : empty)
+      if (keep) {
+        --keep;
+        holes_.push_back({block, block->start, block->end});
+      } else {
+        removeBlock(block);
+      }
+    low_ = blocks_.empty() ? UINTPTR_MAX : blocks_.begin()->first;
+    high_ = blocks_.empty() ? 0 : std::uintptr_t(blocks_.rbegin()->second->end);
+  }
+
+ public:
+  ~Heap() {
+    for (auto &block : blocks_) {
+      free(block.second->start);
+      delete block.second;
+    }
+  }
+
+  void addRoot(char *start, std::size_t size) {
+    roots_.push_back({start, start + size});
+  }
+
+  // Allocate `size` bytes, 8-byte aligned. `pointerFree` objects are never
+  // scanned for pointers.
+  char *allocate(std::size_t size, bool pointerFree, bool zeroed = false) {
+    auto total = granule + (size + granule - 1) / granule * granule;
+    std::uint64_t flag = pointerFree ? noScan : 0;
+    if (total > largeSize) return allocateLarge(total, flag, zeroed);
+    auto &area = allocationArea;
+    if (std::size_t(area.limit - area.bump) < total) refill(total);
+    auto object = area.bump;
+    area.bump += total;
+    header(object) = total | flag;
+    if (zeroed) memset(object + granule, 0, total - granule);
+    return object + granule;
+  }
+};
+
+Heap heap;
+
+// Allocate a string of `length` characters, terminator included. Empty
+// strings are all the same one.
+char *allocString(std::uint64_t length) {
+  if (length == 0) return emptyString.chars;
+  auto header = reinterpret_cast<std::uint64_t *>(
+      heap.allocate(sizeof(std::uint64_t) + length + 1, true));
+  *header = length;
+  auto data = reinterpret_cast<char *>(header + 1);
+  data[length] = '\0';
+  return data;
+}
+
+std::uint64_t length(const char *s) {
+  return reinterpret_cast<const std::uint64_t *>(s)[-1];
+}
+
+// Standard output of Tiger programs. Output is collected in a large buffer
+// and handed to write(2) when it is full, on flush and exit_, before
+// reading input, and, if it goes to a terminal, after each newline.
+class Output {
+  static constexpr std::size_t bufferSize = 64u << 10;
+  char buffer_[bufferSize];
+  std::size_t used_{0};
+  bool lineBuffered_{isatty(STDOUT_FILENO) != 0};
+
+  static void writeAll(const char *data, std::size_t size) {
+    while (size) {
+      auto written = ::write(STDOUT_FILENO, data, size);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        return;
+      }
+      data += written;
+      size -= written;
+    }
+  }
+
+ public:
+  ~Output() { flush(); }
+
+  void flush() {
+    writeAll(buffer_, used_);
+    used_ = 0;
+  }
+
+  bool pending() const { return used_ != 0; }
+
+  void write(const char *data, std::size_t size) {
+    if (size > bufferSize - used_) {
+      flush();
+      if (size >= bufferSize) return writeAll(data, size);
+    }
+    memcpy(buffer_ + used_, data, size);
+    used_ += size;
+    if (lineBuffered_ && memchr(data, '\n', size)) flush();
+  }
+
+  // Write a decimal integer, two digits at a time.
+  void write(std::int64_t value) {
+    static const char digits[] =
+        "000102030405060708091011121314151617181920212223242526272829"
+        "303132333435363738394041424344454647484950515253545556575859"
+        "606162636465666768697071727374757677787980818283848586878889"
+        "90919293949596979899";
+    char text[20];
+    auto end = text + sizeof(text), start = end;
+    std::uint64_t n = value < 0 ? 0 - std::uint64_t(value) : value;
+    for (; n >= 100; n /= 100) {
+      start -= 2;
+      memcpy(start, digits + n % 100 * 2, 2);
+    }
+    if (n >= 10) {
+      start -= 2;
+      memcpy(start, digits + n * 2, 2);
+    } else {
+      *--start = char('0' + n);
+    }
+    if (value < 0) *--start = '-';
+    write(start, end - start);
+  }
+};
+
+Output output;
+
+// Standard input, read(2) a buffer at a time.
+class Input {
+  static constexpr std::size_t bufferSize = 64u << 10;
+  char buffer_[bufferSize];
+  std::size_t position_{0}, end_{0};
+
+ public:
+  // The next byte, or -1 at the end of the input.
+  int get() {
+    if (position_ == end_) {
+      // Show prompts before waiting for the answer.
+      if (output.pending()) output.flush();
+      ssize_t count;
+      do
+        count = ::read(STDIN_FILENO, buffer_, bufferSize);
+      while (count < 0 && errno == EINTR);
+      if (count <= 0) return -1;
+      position_ = 0;
+      end_ = count;
+    }
+    return static_cast<unsigned char>(buffer_[position_++]);
+  }
+};
+
+Input input;
+
+// Stop the program on array sizes that are negative, or too large to be
+// allocated at all.
+void checkArraySize(std::uint64_t size, std::uint64_t elementSize) {
+  if (size <= (UINT64_MAX >> 1) / elementSize) return;
+  output.flush();
+  std::cerr << "Invalid array size " << std::int64_t(size) << std::endl;
+  exit(1);
+}
+}  // namespace
 
 extern "C" {
-void print(char *c) { std::cout << c; }
-void printd(std::uint64_t digit) { std::cout << digit; }
+void print(char *c) { output.write(c, length(c)); }
+void printd(std::int64_t digit) { output.write(digit); }
 std::uint8_t *allocaRecord(std::uint64_t size) {
-  return (std::uint8_t *)malloc(size);
+  return (std::uint8_t *)heap.allocate(size, false);
 }
 
 std::uint8_t *allocaArray(std::uint64_t size, std::uint64_t elementSize) {
-  return (std::uint8_t *)malloc(size * elementSize);
+  checkArraySize(size, elementSize);
+  auto array = reinterpret_cast<std::uint64_t *>(
+      heap.allocate(sizeof(std::uint64_t) + size * elementSize, false));
+  *array = size;
+  return (std::uint8_t *)(array + 1);
 }
 
-void flush() { std::cout.flush(); }
+std::uint8_t *allocaZeroedArray(std::uint64_t size,
+                                std::uint64_t elementSize) {
+  checkArraySize(size, elementSize);
+  auto array = reinterpret_cast<std::uint64_t *>(
+      heap.allocate(sizeof(std::uint64_t) + size * elementSize, false, true));
+  *array = size;
+  return (std::uint8_t *)(array + 1);
+}
+
+void indexOutOfBounds(std::int64_t index, std::int64_t length) {
+  output.flush();
+  std::cerr << "Index " << index << " out of bounds of array of length "
+            << length << std::endl;
+  exit(1);
+}
+
+void addRoot(void *start, std::uint64_t size) {
+  heap.addRoot(static_cast<char *>(start), size);
+}
+
+void flush() { output.flush(); }
 
 char *getchar_() {
-  char *result = new char[2];
-  result[1] = '\0';
-  if (std::cin >> result[0])
-    return result;
-  else {
-    result[0] = '\0';
-    return result;
-  }
+  auto c = input.get();
+  if (c < 0) return emptyString.chars;
+  return charStrings[c].chars;
 }
 
-int ord(char *c) {
-  if (*c > 127 || *c < 0)
+std::int64_t ord(char *c) {
+  if (length(c) == 0 || static_cast<unsigned char>(*c) > 127)
     return -1;
   else
-    return (int)*c;
+    return (std::int64_t)*c;
 }
 
-char *chr(int c) {
+char *chr(std::int64_t c) {
   if (c > 127 || c < 0) exit(-1);
-  return new char[2]{(char)(c), '\0'};
+  return charStrings[c].chars;
 }
 
-int size(char *c) { return std::strlen(c); }
+std::int64_t size(char *c) { return length(c); }
 
-char *substring(char *s, int first, int n) {
-  char *result = new char[n + 1];
+char *substring(char *s, std::int64_t first, std::int64_t n) {
+  auto len = length(s);
+  if (first < 0 || n < 0 || std::uint64_t(first) > len ||
+      std::uint64_t(n) > len - first) {
+    output.flush();
+    std::cerr << "Substring " << first << ", " << n
+              << " out of bounds of string of length " << len
+              << std::endl;
+    exit(1);
+  }
+  if (n == 1) return charStrings[static_cast<unsigned char>(s[first])].chars;
+  char *result = allocString(n);
   memcpy(result, s + first, n);
-  result[n] = '\0';
   return result;
 }
 
 char *concat(char *s1, char *s2) {
-  auto len1 = strlen(s1), len2 = strlen(s2);
-  auto len = len1 + len2;
-  char *result = new char[len + 1];
+  auto len1 = length(s1), len2 = length(s2);
+  if (len2 == 0) return s1;
+  if (len1 == 0) return s2;
+  char *result = allocString(len1 + len2);
   memcpy(result, s1, len1);
   memcpy(result + len1, s2, len2);
-  result[len] = '\0';
   return result;
 }
 
-int not_(int i) {
+std::int64_t not_(std::int64_t i) {
   return i == 0;
 }
 
-void exit_(int i) {
-  exit(i);
+void exit_(std::int64_t i) {
+  output.flush();
+  exit(static_cast<int>(i));
+}
+
+std::int64_t strcmp_(char *a, char *b) {
+  if (a == b) return 0;
+  auto lenA = length(a), lenB = length(b);
+  auto result = memcmp(a, b, lenA < lenB ? lenA : lenB);
+  if (result != 0) return result;
+  return lenA < lenB ? -1 : lenA > lenB;
 }
 
-int strcmp_(char *a, char *b) {
-  return std::strcmp(a, b);
+void divisionByZero() {
+  output.flush();
+  std::cerr << "Division by zero" << std::endl;
+  exit(1);
 }
 
 }
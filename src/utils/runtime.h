@@ -0,0 +1,63 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+#include <cstdint>
+
+// Runtime library of Tiger programs. Generated code calls these functions by
+// name; the JIT resolves them to the definitions linked into the compiler.
+//
+// A Tiger string points at its characters, which are NUL terminated and
+// preceded by their length as a 64-bit integer:
+//
+//   [ i64 length | chars ... | '\0' ]
+//                  ^ string
+//
+// so that size is O(1) and concat and comparisons are bounded memcpy/memcmp.
+// Strings are immutable and may be shared.
+//
+// Arrays likewise point at their first element, preceded by the number of
+// elements, for -fbounds-check.
+extern "C" {
+// The part of the heap generated code bump allocates in inline: an object of
+// n bytes (rounded up to 8) takes a header word holding n + 8 followed by the
+// object, at `bump`, as long as it fits below `limit`. Otherwise code calls
+// allocaRecord or allocaArray, which refill the area.
+struct AllocationArea {
+  char *bump;
+  char *limit;
+};
+extern AllocationArea allocationArea;
+
+// Strings of one character, laid out like the others, indexed by the
+// character, and the empty string. The runtime never allocates these, and
+// generated code refers to them for literals, chr and substring of length 1.
+struct StaticString {
+  std::uint64_t length;
+  char chars[8];
+};
+extern StaticString charStrings[256];
+extern StaticString emptyString;
+
+void print(char *c);
+void printd(std::int64_t digit);
+std::uint8_t *allocaRecord(std::uint64_t size);
+std::uint8_t *allocaArray(std::uint64_t size, std::uint64_t elementSize);
+std::uint8_t *allocaZeroedArray(std::uint64_t size, std::uint64_t elementSize);
+// Have the collector scan [start, start + size) for pointers, called by the
+// initializers of library units on their global frame.
+void addRoot(void *start, std::uint64_t size);
+void flush();
+char *getchar_();
+std::int64_t ord(char *c);
+char *chr(std::int64_t c);
+std::int64_t size(char *c);
+char *substring(char *s, std::int64_t first, std::int64_t n);
+char *concat(char *s1, char *s2);
+std::int64_t not_(std::int64_t i);
+void exit_(std::int64_t i);
+std::int64_t strcmp_(char *a, char *b);
+[[noreturn]] void divisionByZero();
+[[noreturn]] void indexOutOfBounds(std::int64_t index, std::int64_t length);
+}
+
+#endif  // RUNTIME_H
@@ -0,0 +1,16 @@
+#include "symbol.h"
+#include <llvm/ADT/Hashing.h>
+#include <mutex>
+
+const Symbol::Entry *Symbol::intern(llvm::StringRef name) {
+  // The empty name is the null symbol, so that Symbol() == Symbol("").
+  if (name.empty()) return nullptr;
+  static llvm::StringMap<std::size_t> pool;
+  // Units are generated on several threads.
+  static std::mutex poolMutex;
+  std::lock_guard<std::mutex> lock(poolMutex);
+  auto result = pool.insert({name, 0u});
+  if (result.second)
+    result.first->second = static_cast<std::size_t>(llvm::hash_value(name));
+  return &*result.first;
+}
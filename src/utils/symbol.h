@@ -0,0 +1,50 @@
+#ifndef SYMBOL_H
+#define SYMBOL_H
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <cstddef>
+#include <functional>
+#include <string>
+
+// Interned identifier. Every distinct name is stored once in a global pool
+// together with its hash, so a Symbol is a single pointer: comparing two of
+// them is a pointer comparison and hashing one reads the precomputed hash.
+//
+// The default constructor is trivial so that Symbol can live in the parser
+// %union; use Symbol() or Symbol{} for the empty symbol.
+class Symbol {
+ public:
+  using Entry = llvm::StringMapEntry<std::size_t>;
+
+ private:
+  const Entry *entry_;
+
+  static const Entry *intern(llvm::StringRef name);
+
+ public:
+  Symbol() = default;
+  Symbol(const char *name) : entry_(intern(name)) {}
+  Symbol(std::string const &name) : entry_(intern(name)) {}
+  Symbol(llvm::StringRef name) : entry_(intern(name)) {}
+
+  llvm::StringRef ref() const {
+    return entry_ ? entry_->getKey() : llvm::StringRef();
+  }
+  std::string str() const { return ref().str(); }
+  bool empty() const { return !entry_; }
+  std::size_t hash() const { return entry_ ? entry_->getValue() : 0u; }
+
+  bool operator==(Symbol const &other) const { return entry_ == other.entry_; }
+  bool operator!=(Symbol const &other) const { return entry_ != other.entry_; }
+  bool operator<(Symbol const &other) const { return entry_ < other.entry_; }
+};
+
+namespace std {
+template <>
+struct hash<Symbol> {
+  size_t operator()(Symbol const &symbol) const { return symbol.hash(); }
+};
+}  // namespace std
+
+#endif  // SYMBOL_H
@@ -3,22 +3,37 @@
 
 #include <deque>
 #include <memory>
-#include <string>
 #include <unordered_map>
+#include <vector>
+#include "symbol.h"
 
+// Scoped symbol table keyed by interned Symbols. Every name maps to a chain
+// of its bindings, the innermost one at the back, so that a lookup is a
+// single hash probe no matter how deep the scopes are. Each scope logs the
+// names bound in it and undoes exactly those bindings on exit().
 template <typename T>
 class SymbolTable {
-  std::deque<std::unordered_map<std::string, T *>> stack_;
+  struct Binding {
+    T *value;
+    size_t depth;
+  };
+  using Chain = std::vector<Binding>;
+  using Entry = typename std::unordered_map<Symbol, Chain>::value_type;
+
+  // Entries are never erased before reset(), so the undo logs can keep
+  // pointers to them.
+  std::unordered_map<Symbol, Chain> bindings_;
+  std::vector<std::vector<Entry *>> scopes_;
 
  public:
   SymbolTable();
   ~SymbolTable();
-  T *&operator[](std::string const &name);
-  T *&lookup(std::string const &name);
-  T *&lookupOne(std::string const &name);
-  void push(std::string const &name, T *const val);
-  void pop(std::string const &name);
-  void popOne(std::string const &name);
+  T *operator[](Symbol name) const;
+  T *lookup(Symbol name) const;
+  T *lookupOne(Symbol name) const;
+  void push(Symbol name, T *const val);
+  void pop(Symbol name);
+  void popOne(Symbol name);
   void enter();
   void exit();
   void reset();
@@ -35,46 +50,67 @@ SymbolTable<T>::~SymbolTable() {
 }
 
 template <typename T>
-T *&SymbolTable<T>::operator[](const std::string &name) {
+T *SymbolTable<T>::operator[](Symbol name) const {
   return lookup(name);
 }
 
 template <typename T>
-T *&SymbolTable<T>::lookup(const std::string &name) {
-  for (auto stack : stack_)
-    if (stack[name]) return stack[name];
-  return stack_.front()[name];
+T *SymbolTable<T>::lookup(Symbol name) const {
+  auto entry = bindings_.find(name);
+  if (entry == bindings_.end() || entry->second.empty()) return nullptr;
+  return entry->second.back().value;
 }
 
 template <typename T>
-T *&SymbolTable<T>::lookupOne(const std::string &name) {
-  if (stack_.front()[name]) return stack_.front()[name];
-  return stack_.front()[name];
+T *SymbolTable<T>::lookupOne(Symbol name) const {
+  auto entry = bindings_.find(name);
+  if (entry == bindings_.end() || entry->second.empty()) return nullptr;
+  auto &binding = entry->second.back();
+  return binding.depth == scopes_.size() ? binding.value : nullptr;
 }
 
 template <typename T>
-void SymbolTable<T>::push(const std::string &name, T *const val) {
-  stack_.front()[name] = val;
+void SymbolTable<T>::push(Symbol name, T *const val) {
+  auto &entry = *bindings_.emplace(name, Chain()).first;
+  auto &chain = entry.second;
+  // Binding a name twice in one scope replaces it.
+  if (!chain.empty() && chain.back().depth == scopes_.size()) {
+    chain.back().value = val;
+    return;
+  }
+  chain.push_back({val, scopes_.size()});
+  scopes_.back().push_back(&entry);
 }
 
 template <typename T>
-void SymbolTable<T>::popOne(const std::string &name) {
-  stack_.front().erase(name);
+void SymbolTable<T>::popOne(Symbol name) {
+  auto entry = bindings_.find(name);
+  if (entry == bindings_.end()) return;
+  auto &chain = entry->second;
+  if (!chain.empty() && chain.back().depth == scopes_.size()) chain.pop_back();
 }
 
 template <typename T>
 void SymbolTable<T>::enter() {
-  stack_.push_front(std::unordered_map<std::string, T *>());
+  scopes_.emplace_back();
 }
 
 template <typename T>
 void SymbolTable<T>::exit() {
-  stack_.pop_front();
+  // A name may be logged more than once if it was popped and pushed again,
+  // the depth check makes the extra entries no-ops.
+  for (auto entry : scopes_.back()) {
+    auto &chain = entry->second;
+    if (!chain.empty() && chain.back().depth == scopes_.size())
+      chain.pop_back();
+  }
+  scopes_.pop_back();
 }
 
 template <typename T>
 void SymbolTable<T>::reset() {
-  stack_.clear();
+  bindings_.clear();
+  scopes_.clear();
   enter();
 }
 
@@ -0,0 +1,75 @@
+#include "timereport.h"
+#include <llvm/IR/PassTimingInfo.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/Timer.h>
+#include <sys/resource.h>
+
+static std::chrono::nanoseconds cpuTime() {
+  llvm::sys::TimePoint<> elapsed;
+  std::chrono::nanoseconds user, system;
+  llvm::sys::Process::GetTimeUsage(elapsed, user, system);
+  return user + system;
+}
+
+static std::uint64_t peakMemory() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return std::uint64_t(usage.ru_maxrss) * 1024;
+#endif
+}
+
+TimeReport::Phase::Phase(TimeReport *report, std::string unit,
+                         std::string phase)
+    : report_(report), unit_(std::move(unit)), phase_(std::move(phase)) {
+  if (!report_) return;
+  wallStart_ = std::chrono::steady_clock::now();
+  cpuStart_ = cpuTime();
+}
+
+TimeReport::Phase::~Phase() {
+  if (!report_) return;
+  std::chrono::duration<double, std::milli> wall =
+      std::chrono::steady_clock::now() - wallStart_;
+  std::chrono::duration<double, std::milli> cpu = cpuTime() - cpuStart_;
+  std::lock_guard<std::mutex> lock(report_->mutex_);
+  report_->entries_.push_back(
+      {unit_, phase_, wall.count(), cpu.count(), peakMemory()});
+}
+
+void TimeReport::print(llvm::raw_ostream &out, bool json) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (json) {
+    out << "{\n  \"phases\": [";
+    const char *separator = "\n";
+    for (auto &entry : entries_) {
+      out << separator << "    {\"unit\": \"" << entry.unit
+          << "\", \"phase\": \"" << entry.phase
+          << "\", \"wall_ms\": " << llvm::format("%.3f", entry.wall)
+          << ", \"cpu_ms\": " << llvm::format("%.3f", entry.cpu)
+          << ", \"peak_memory_bytes\": " << entry.peakMemory << "}";
+      separator = ",\n";
+    }
+    // The pass timers are printed as "<group>.<pass>.<field>": <value>.
+    out << "\n  ],\n  \"passes\": {";
+    llvm::TimerGroup::printAllJSONValues(out, "\n");
+    out << "\n  }\n}\n";
+    // Printed already, not again at exit.
+    llvm::TimerGroup::clearAll();
+  } else {
+    out << "===" << std::string(73, '-') << "===\n"
+        << "                      Tiny Tiger compilation time report\n"
+        << "===" << std::string(73, '-') << "===\n"
+        << "   Wall (ms)     CPU (ms)   Peak memory (MiB)   Phase\n";
+    for (auto &entry : entries_)
+      out << llvm::format("%12.3f %12.3f %19.1f", entry.wall, entry.cpu,
+                          entry.peakMemory / 1048576.0)
+          << "   " << entry.unit << ": " << entry.phase << "\n";
+    out << "\n";
+    llvm::reportAndResetTimings();
+  }
+  out.flush();
+}
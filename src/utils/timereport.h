@@ -0,0 +1,48 @@
+#ifndef TIMEREPORT_H
+#define TIMEREPORT_H
+
+#include <llvm/Support/raw_ostream.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Time and memory spent in each phase of the compiler, for -ftime-report.
+// Phases of different units may run at the same time on different threads;
+// the CPU time of a phase is that of the whole process, so it includes the
+// other units' work done meanwhile, as well as the backend threads of a
+// split module. The peak memory is the resident high-water mark of the
+// process at the end of the phase.
+class TimeReport {
+  struct Entry {
+    std::string unit;
+    std::string phase;
+    double wall;
+    double cpu;
+    std::uint64_t peakMemory;
+  };
+
+  std::mutex mutex_;
+  std::vector<Entry> entries_;
+
+ public:
+  // Times the scope it lives in. Does nothing if `report` is null.
+  class Phase {
+    TimeReport *report_;
+    std::string unit_;
+    std::string phase_;
+    std::chrono::steady_clock::time_point wallStart_;
+    std::chrono::nanoseconds cpuStart_;
+
+   public:
+    Phase(TimeReport *report, std::string unit, std::string phase);
+    Phase(Phase const &) = delete;
+    Phase &operator=(Phase const &) = delete;
+    ~Phase();
+  };
+
+  // A table, or a JSON object with the phases and the LLVM pass timers.
+  void print(llvm::raw_ostream &out, bool json);
+};
+
+#endif  // TIMEREPORT_H